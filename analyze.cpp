@@ -6,7 +6,9 @@
 #include <cstdlib>
 #include <regex>
 #include <set>
-#include <unordered_set>
+#include <map>
+#include <unordered_map>
+#include <bitset>
 
 // The PICO-8 1-byte charset (excluding "\n")
 std::string CHARSET = " 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
@@ -14,18 +16,22 @@ std::string CHARSET = " 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~
 // The input cart code
 std::string INPUT;
 
+// A set of characters; testing one is a single bit lookup, and copying
+// one is cheap
+typedef std::bitset<256> charset;
+
+static bool has(charset const &set, char c) { return set[(uint8_t)c]; }
 
 struct context
 {
     context()
     {
-        for (int i = 0; i < 256; ++i)
-            excluded.insert(i);
+        excluded.set();
         for (char c : CHARSET)
-            excluded.erase(c);
+            excluded.reset((uint8_t)c);
     }
 
-    std::unordered_set<char> excluded;
+    charset excluded;
 
     std::string prefix;
     std::string suffix;
@@ -35,12 +41,12 @@ struct context
 
 int best_streak(int start_pos, context const &ctx)
 {
-    std::unordered_set<char> excluded = ctx.excluded;
+    charset excluded = ctx.excluded;
 
     // Skip excluded chars until we reach EOF or a non-excluded char
     int best_len = 0;
     while (start_pos + best_len < (int)INPUT.size()
-            && excluded.count(INPUT[start_pos + best_len]))
+            && has(excluded, INPUT[start_pos + best_len]))
         ++best_len;
 
     // Check that _all_ skipped characters match the current LUT
@@ -50,17 +56,152 @@ int best_streak(int start_pos, context const &ctx)
         if (ctx.prefix[ctx.prefix.size() - best_len + i] != INPUT[start_pos + i])
             return 0;
 
-    // Count how many more characters match
+    // Count how many more characters match; a streak without new
+    // characters would not change the context
+    int skipped = best_len;
     while (start_pos + best_len < (int)INPUT.size()
-            && excluded.count(INPUT[start_pos + best_len]) == 0)
-        excluded.insert(INPUT[start_pos + best_len++]);
-    return best_len;
+            && !has(excluded, INPUT[start_pos + best_len]))
+        excluded.set((uint8_t)INPUT[start_pos + best_len++]);
+    return best_len > skipped ? best_len : 0;
+}
+
+// Upper bound on the score that streaks can still add to ctx. Each streak
+// has a first new character, which is a different one for each streak,
+// so the bound is the sum, over characters that are not excluded, of the
+// best score of a streak where that character comes first. Such a streak
+// is a run of different characters that are not excluded yet, except that
+// when it skips all the characters appended since ctx, it also skips the
+// end of the current prefix before them.
+int upper_bound(context const &ctx)
+{
+    int const size = (int)INPUT.size();
+
+    // widest[pos] is the longest run of different characters that are not
+    // excluded yet, among those that contain pos
+    std::vector<int> widest(size);
+    charset seen;
+    for (int start = 0, end = 0; start < size; ++start)
+    {
+        if (end < start)
+            end = start, seen.reset();
+        while (end < size && !has(ctx.excluded, INPUT[end]) && !has(seen, INPUT[end]))
+            seen.set((uint8_t)INPUT[end++]);
+        for (int pos = start; pos < end; ++pos)
+            widest[pos] = std::max(widest[pos], end - start);
+        seen.reset((uint8_t)INPUT[start]);
+    }
+
+    int best[256] = {};
+    for (int pos = 0; pos < size; ++pos)
+    {
+        if (has(ctx.excluded, INPUT[pos]))
+            continue;
+
+        // The longest run that skips all the new characters before pos
+        seen.reset();
+        seen.set((uint8_t)INPUT[pos]);
+        int start = pos, end = pos + 1;
+        while (start > 0 && !has(ctx.excluded, INPUT[start - 1]) && !has(seen, INPUT[start - 1]))
+            seen.set((uint8_t)INPUT[--start]);
+        while (end < size && !has(ctx.excluded, INPUT[end]) && !has(seen, INPUT[end]))
+            seen.set((uint8_t)INPUT[end++]);
+        int len = end - start;
+        for (int i = 1; i <= start && i <= (int)ctx.prefix.size()
+                         && INPUT[start - i] == ctx.prefix[ctx.prefix.size() - i]; ++i)
+            ++len;
+
+        len = std::max(len, widest[pos]);
+        int &b = best[(uint8_t)INPUT[pos]];
+        b = std::max(b, len >= 4 ? len - 2 : 0);
+    }
+
+    int ret = 0;
+    for (int n : best)
+        ret += n;
+    return ret;
+}
+
+// What is known about the best score that streaks can add to a context:
+// at least lo, reached with the given final prefix, and at most hi. The
+// context only depends on its prefix, because the excluded characters are
+// the initial ones and the ones in the prefix.
+struct outcome
+{
+    int lo = 0, hi = 0;
+    std::string added; // what the best streaks append to the prefix
+};
+
+std::unordered_map<std::string, outcome> memo;
+
+// The memo is only a cache, so it is simply cleared when it gets too big
+size_t const max_memo = 1 << 20;
+
+outcome const &remember(std::string const &key, outcome const &o)
+{
+    if (memo.size() >= max_memo)
+        memo.clear();
+    return memo[key] = o;
+}
+
+// Contexts with the same excluded characters and the same end of prefix
+// have the same future: skips can only match a part of the prefix that
+// also appears in the input
+std::string state(context const &ctx)
+{
+    size_t len = 0;
+    while (len < ctx.prefix.size()
+            && INPUT.find(ctx.prefix.c_str() + ctx.prefix.size() - len - 1) != std::string::npos)
+        ++len;
+
+    std::string ret(32, '\0');
+    for (int c = 0; c < 256; ++c)
+        if (ctx.excluded[c])
+            ret[c / 8] |= 1 << (c % 8);
+    return ret + ctx.prefix.substr(ctx.prefix.size() - len);
 }
 
 int global_best = 0;
 
-void analyze(context const &ctx, int depth = 0)
+void report(context const &ctx, std::string const &prefix, int score)
+{
+    if (score <= global_best)
+        return;
+    global_best = score;
+    std::string result = prefix;
+
+    for (char c : CHARSET)
+        if (!has(ctx.excluded, c) && prefix.find(c) == std::string::npos)
+            result += c;
+
+    // Handle suffix
+    result += ctx.suffix;
+
+    printf("final string (score %d): \"%s\"\n", score, result.c_str());
+}
+
+// Branch and bound search: contexts that cannot beat the best score found
+// so far are not explored, and what is known about each context is kept
+// in memo[] for the next time another order of streaks leads to it
+outcome analyze(context const &ctx, int depth = 0)
 {
+    std::string const key = state(ctx);
+    auto known = memo.find(key);
+    if (known != memo.end())
+    {
+        outcome const &o = known->second;
+        report(ctx, ctx.prefix + o.added, ctx.score + o.lo);
+        if (o.lo == o.hi || ctx.score + o.hi <= global_best)
+            return o;
+    }
+
+    outcome ret;
+    ret.hi = upper_bound(ctx);
+    if (known != memo.end())
+        ret = known->second;
+    if (ctx.score + ret.hi <= global_best)
+        return remember(key, ret);
+
+    // Try the longest streaks first, they lead to good scores sooner
     std::set<uint32_t> streaks;
 
     for (int pos = 0; pos < (int)INPUT.size(); ++pos)
@@ -77,53 +218,44 @@ void analyze(context const &ctx, int depth = 0)
 
     if (streaks.size() == 0)
     {
-        if (ctx.score > global_best)
-        {
-            global_best = ctx.score;
-            std::string result = ctx.prefix;
-
-            for (char c : CHARSET)
-                if (ctx.excluded.count(c) == 0)
-                    result += c;
-
-            // Handle suffix
-            result += ctx.suffix;
-
-            printf("final string (score %d): \"%s\"\n", ctx.score, result.c_str());
-        }
-        return;
+        report(ctx, ctx.prefix, ctx.score);
+        ret.lo = ret.hi = 0;
+        ret.added.clear();
+        return remember(key, ret);
     }
 
     // Test all streaks
-    int n = 0;
+    int n = 0, hi = 0;
     for (auto val : streaks)
     {
         int pos = (-val) & ((1 << 16) - 1);
         int size = (-val) >> 16;
 
         if (depth < 2)
-        {
             printf("[%d] testing streak %d/%d at %d: %d -- '%s'\n", depth, n, (int)streaks.size(), pos, size, INPUT.substr(pos, size).c_str());
-            global_best = 0;
-        }
         ++n;
 
         context newctx = ctx;
         newctx.score += size - 2;
 
         for (int i = 0; i < size; ++i)
-            if (!newctx.excluded.count(INPUT[pos + i]))
+            if (!has(newctx.excluded, INPUT[pos + i]))
             {
-                newctx.prefix += INPUT.substr(pos + i, size - i).c_str();
+                newctx.prefix.append(INPUT, pos + i, size - i);
                 break;
             }
 
         for (int i = 0; i < size; ++i)
-            newctx.excluded.insert(INPUT[pos + i]);
+            newctx.excluded.set((uint8_t)INPUT[pos + i]);
 
-        analyze(newctx, depth + 1);
+        outcome o = analyze(newctx, depth + 1);
+        if (size - 2 + o.lo > ret.lo)
+            ret.lo = size - 2 + o.lo, ret.added = newctx.prefix.substr(ctx.prefix.size()) + o.added;
+        hi = std::max(hi, size - 2 + o.hi);
     }
 
+    ret.hi = std::min(ret.hi, hi);
+    return remember(key, ret);
 }
 
 std::map<char, int> frequencies;
@@ -140,7 +272,7 @@ int main()//int argc, char *argv[])
 
     // Exclude characters that would be encoded as multibyte
     for (char c : ctx.prefix + ctx.suffix)
-        ctx.excluded.insert(c);
+        ctx.excluded.set((uint8_t)c);
 
     // Replace inline strings with """""""… sequences so that
     // our stats don't get messed up by the contents of that string.
@@ -150,7 +282,7 @@ int main()//int argc, char *argv[])
 
         if (INPUT[pos] == '"' && (pos == 0 || INPUT[pos - 1] != '\\'))
             in_string = 1 - in_string;
-        if (in_string && !ctx.excluded.count(INPUT[pos]))
+        if (in_string && !has(ctx.excluded, INPUT[pos]))
             INPUT[pos] = '"';
     }
 
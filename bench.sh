@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# Print the minified size of each decoder profile given on the command line,
+# next to the CPU time it takes to decode a payload, in frames as reported
+# by stat(1). Usage: ./bench.sh [--pico8] <profile>... [-- <payload>...]
+
+PATH="$PATH:$HOME/zepto8"
+PATH="$PATH:$HOME/pico-8"
+
+TMPFILE=.p8z-bench.p8
+TOOL="z8tool run --headless"
+PROFILES=""
+PAYLOADS=""
+
+while [ -n "$1" ]; do
+  case "$1" in
+    --pico8)
+      export DISPLAY=:0
+      TMPFILE=.p8z-pico8.p8
+      TOOL="pico8 -x"
+      ;;
+    --)
+      shift
+      PAYLOADS="$*"
+      break
+      ;;
+    *)
+      PROFILES="$PROFILES $1"
+      ;;
+  esac
+  shift
+done
+
+PAYLOADS="${PAYLOADS:-p8u.p8 zlib/trees.c}"
+
+bench() {
+  # RAM-only profiles get all the data in cart RAM, string-only ones none
+  case "$1" in
+    *_ram) EXTRA=17152 ;;
+    *_string) EXTRA=0 ;;
+    *) EXTRA=2048 ;;
+  esac
+  head -n 3 p8u.p8 > "$TMPFILE.tmp.p8"
+  cat "$1" >> "$TMPFILE.tmp.p8"
+  printf 'c=' >> "$TMPFILE.tmp.p8"
+  head -c 16384 "$2" | ./p8z --count $EXTRA > "$TMPFILE.data" 2>/dev/null
+  head -c 16384 "$2" | ./p8z --skip $EXTRA >> "$TMPFILE.tmp.p8" 2>/dev/null
+  echo "s=stat(1) p8u(c,0,$EXTRA) printh(stat(1)-s)" >> "$TMPFILE.tmp.p8"
+  z8tool convert --data "$TMPFILE.data" "$TMPFILE.tmp.p8" "$TMPFILE"
+  rm -f "$TMPFILE.tmp.p8" "$TMPFILE.data"
+  $TOOL "$TMPFILE"
+}
+
+printf '%-16s %6s' "profile" "chars"
+for p in $PAYLOADS; do printf ' %14s' "$(basename "$p")"; done
+echo ""
+for i in $PROFILES; do
+  printf '%-16s %6s' "$i" "$(wc -c < "$i")"
+  for p in $PAYLOADS; do printf ' %14s' "$(bench "$i" "$p")"; done
+  echo ""
+done
+
+rm -f "$TMPFILE"
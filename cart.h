@@ -0,0 +1,245 @@
+//
+// PICO-8 .p8 cartridge reader and writer, shared by minify and p8z
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+
+// A .p8 cart is a two-line header followed by sections such as __lua__ or
+// __gfx__. Sections are kept as raw text in file order, so that the ones
+// that are not modified are written back unchanged.
+struct cart
+{
+    struct section
+    {
+        std::string name;
+        std::string text;
+        int line; // line number of the first line of text
+    };
+
+    std::string header;
+    std::vector<section> sections;
+
+    // Where each data section lives in the 0x4300-byte cart ROM, and how
+    // many lines of how many characters it uses in the .p8 file
+    struct layout
+    {
+        char const *name;
+        size_t addr, size, lines, width;
+    };
+
+    static std::vector<layout> const &layouts()
+    {
+        static std::vector<layout> const ret =
+        {
+            { "gfx", 0x0000, 0x2000, 128, 128 },
+            { "map", 0x2000, 0x1000, 32, 256 },
+            { "gff", 0x3000, 0x0100, 2, 256 },
+            { "music", 0x3100, 0x0100, 64, 11 },
+            { "sfx", 0x3200, 0x1100, 64, 168 },
+        };
+        return ret;
+    }
+
+    static layout const *find_layout(std::string const &name)
+    {
+        for (auto const &l : layouts())
+            if (name == l.name)
+                return &l;
+        return nullptr;
+    }
+
+    // Parse a .p8 file; fails if it does not start with the cart header
+    bool parse(std::string const &s)
+    {
+        if (s.compare(0, 16, "pico-8 cartridge") != 0)
+            return false;
+
+        header.clear();
+        sections.clear();
+        int line = 1;
+        for (size_t i = 0; i < s.size(); ++line)
+        {
+            size_t end = s.find('\n', i);
+            end = end == std::string::npos ? s.size() : end + 1;
+            std::string name;
+            if (is_marker(s, i, end, name))
+                sections.push_back(section{ name, "", line + 1 });
+            else
+                (sections.empty() ? header : sections.back().text) += s.substr(i, end - i);
+            i = end;
+        }
+        return true;
+    }
+
+    std::string str() const
+    {
+        std::string ret = header;
+        for (auto const &sec : sections)
+        {
+            if (ret.size() && ret.back() != '\n')
+                ret += '\n';
+            ret += "__" + sec.name + "__\n" + sec.text;
+        }
+        return ret;
+    }
+
+    section *find(std::string const &name)
+    {
+        for (auto &sec : sections)
+            if (sec.name == name)
+                return &sec;
+        return nullptr;
+    }
+
+    // Add an empty section where PICO-8 would put it
+    section &add(std::string const &name)
+    {
+        static char const *order[] = { "lua", "gfx", "label", "gff", "map", "sfx", "music" };
+        auto rank = [](std::string const &n) -> int
+        {
+            for (int i = 0; i < 7; ++i)
+                if (n == order[i])
+                    return i;
+            return 7;
+        };
+        auto it = sections.begin();
+        while (it != sections.end() && rank(it->name) <= rank(name))
+            ++it;
+        return *sections.insert(it, section{ name, "", 0 });
+    }
+
+    // Decode the data sections to cart ROM; missing data is zero
+    std::vector<uint8_t> rom() const
+    {
+        std::vector<uint8_t> ret(0x4300);
+        for (auto const &sec : sections)
+        {
+            layout const *l = find_layout(sec.name);
+            if (!l)
+                continue;
+            size_t const stride = l->size / l->lines;
+            size_t i = 0;
+            for (size_t n = 0; n < l->lines && i < sec.text.size(); ++n)
+            {
+                size_t end = sec.text.find('\n', i);
+                end = end == std::string::npos ? sec.text.size() : end;
+                std::string text = sec.text.substr(i, end - i);
+                text.resize(l->width, '0');
+                decode_line(*l, text, ret.data() + l->addr + n * stride);
+                i = end + 1;
+            }
+        }
+        return ret;
+    }
+
+    // Write back the data sections that overlap [begin, end) in cart ROM
+    void set_rom(std::vector<uint8_t> const &data, size_t begin, size_t end)
+    {
+        for (auto const &l : layouts())
+        {
+            if (l.addr >= end || l.addr + l.size <= begin)
+                continue;
+            section *sec = find(l.name);
+            if (!sec)
+                sec = &add(l.name);
+            size_t const stride = l.size / l.lines;
+            sec->text.clear();
+            for (size_t n = 0; n < l.lines; ++n)
+                sec->text += encode_line(l, data.data() + l.addr + n * stride) + '\n';
+        }
+    }
+
+private:
+    static bool is_marker(std::string const &s, size_t i, size_t end, std::string &name)
+    {
+        while (end > i && (s[end - 1] == '\n' || s[end - 1] == '\r'))
+            --end;
+        if (end - i < 5 || s.compare(i, 2, "__") != 0 || s.compare(end - 2, 2, "__") != 0)
+            return false;
+        for (size_t j = i + 2; j < end - 2; ++j)
+            if (!isalnum((unsigned char)s[j]) && s[j] != '_' && s[j] != ':')
+                return false;
+        name = s.substr(i + 2, end - i - 4);
+        return true;
+    }
+
+    static int hex(char ch)
+    {
+        return ch >= '0' && ch <= '9' ? ch - '0'
+             : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+             : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : 0;
+    }
+
+    static int hex2(std::string const &s, size_t i) { return hex(s[i]) << 4 | hex(s[i + 1]); }
+
+    // gfx bytes store the left pixel in the low nibble, but the .p8 file
+    // lists pixels left to right. Music patterns are "FF AABBCCDD" with the
+    // flags stored in bit 7 of each channel byte. sfx lines have a 4-byte
+    // header then 32 notes of 5 digits (pitch, waveform, volume, effect),
+    // while in ROM the 16-bit notes come first and the header last.
+    static void decode_line(layout const &l, std::string const &s, uint8_t *out)
+    {
+        std::string name = l.name;
+        if (name == "gfx")
+            for (size_t j = 0; j < 64; ++j)
+                out[j] = hex(s[2 * j]) | hex(s[2 * j + 1]) << 4;
+        else if (name == "music")
+            for (size_t j = 0; j < 4; ++j)
+                out[j] = (hex2(s, 3 + 2 * j) & 0x7f) | (hex2(s, 0) >> j & 1) << 7;
+        else if (name == "sfx")
+        {
+            for (size_t j = 0; j < 4; ++j)
+                out[64 + j] = hex2(s, 2 * j);
+            for (size_t j = 0; j < 32; ++j)
+            {
+                size_t k = 8 + 5 * j;
+                int w = hex(s[k + 2]);
+                int note = (hex2(s, k) & 0x3f) | (w & 7) << 6 | (hex(s[k + 3]) & 7) << 9
+                         | (hex(s[k + 4]) & 7) << 12 | (w >> 3) << 15;
+                out[2 * j] = note & 0xff;
+                out[2 * j + 1] = note >> 8;
+            }
+        }
+        else
+            for (size_t j = 0; j < l.width / 2; ++j)
+                out[j] = hex2(s, 2 * j);
+    }
+
+    static std::string encode_line(layout const &l, uint8_t const *in)
+    {
+        std::string name = l.name, ret;
+        char buf[16];
+        if (name == "gfx")
+            for (size_t j = 0; j < 64; ++j)
+                snprintf(buf, sizeof(buf), "%x%x", in[j] & 0xf, in[j] >> 4), ret += buf;
+        else if (name == "music")
+        {
+            snprintf(buf, sizeof(buf), "%02x %02x%02x%02x%02x",
+                     in[0] >> 7 | (in[1] >> 7) << 1 | (in[2] >> 7) << 2 | (in[3] >> 7) << 3,
+                     in[0] & 0x7f, in[1] & 0x7f, in[2] & 0x7f, in[3] & 0x7f);
+            ret = buf;
+        }
+        else if (name == "sfx")
+        {
+            for (size_t j = 0; j < 4; ++j)
+                snprintf(buf, sizeof(buf), "%02x", in[64 + j]), ret += buf;
+            for (size_t j = 0; j < 32; ++j)
+            {
+                int note = in[2 * j] | in[2 * j + 1] << 8;
+                snprintf(buf, sizeof(buf), "%02x%x%x%x", note & 0x3f,
+                         (note >> 6 & 7) | (note >> 15) << 3, note >> 9 & 7, note >> 12 & 7);
+                ret += buf;
+            }
+        }
+        else
+            for (size_t j = 0; j < l.width / 2; ++j)
+                snprintf(buf, sizeof(buf), "%02x", in[j]), ret += buf;
+        return ret;
+    }
+};
@@ -1,78 +1,91 @@
-
-#include <vector>
 #include <iostream>
+#include <fstream>
 #include <streambuf>
-#include <cstdint>
 #include <cstdlib>
-#include <regex>
-
-int main()
-{
-    auto input = std::string{ std::istreambuf_iterator<char>(std::cin),
-                              std::istreambuf_iterator<char>() };
+#include <string>
+#include <set>
 
-    std::regex re_spaces(" +");
+#include "cart.h"
+#include "minify.h"
 
-    // Split input into lines
-    std::vector<std::string> lines;
-    std::regex re_crlf("\r*\n");
-    std::copy(std::sregex_token_iterator(input.begin(), input.end(), re_crlf, -1),
-              std::sregex_token_iterator(),
-              std::back_inserter(lines));
+extern "C" z_const char * const z_errmsg[] = {};
 
-    // Skip first three lines (they’re the PICO-8 cart header)
-    lines.erase(lines.begin(), lines.begin() + 3);
+int main(int argc, char *argv[])
+{
+    // Decoder variants: lines tagged "-- +name" are only kept when name is
+    // given on the command line, and lines tagged "-- -name" only when it is
+    // not; a line may carry several tags, e.g. "-- +fast -poke"
+    std::set<std::string> features;
+    bool search = false, whole_cart = false, print_stats = false;
+    char const *cache_file = nullptr;
+    for (int i = 1; i < argc; ++i)
+        if (argv[i] == std::string("--cache") && i + 1 < argc)
+            cache_file = argv[++i];
+        else if (argv[i] == std::string("--search"))
+            search = true;
+        else if (argv[i] == std::string("--cart"))
+            whole_cart = true;
+        else if (argv[i] == std::string("--stats"))
+            print_stats = true;
+        else if (argv[i][0] == '-')
+        {
+            std::cerr << "minify: unknown option " << argv[i] << "\n";
+            return EXIT_FAILURE;
+        }
+        else
+            features.insert(argv[i]);
 
-    std::vector<std::tuple<std::string, std::string>> replaces;
-    std::string result;
+    auto input = std::string{ std::istreambuf_iterator<char>(std::cin),
+                              std::istreambuf_iterator<char>() };
 
-    // Process each line
-    for (auto & line : lines)
+    // With --cache, the parts of the code that did not change since the
+    // last run are not lexed again
+    cache cached;
+    if (cache_file)
     {
-        // Parse special comments indicating possible replacements
-        static std::regex re_replaces("^(.*--.*replaces: |.*)");
-        static std::regex re_replace_pair(" *([^ ]+) *([^ ]+) *");
-        std::vector<std::string> replaces_list;
-        auto tmp = std::regex_replace(line, re_replaces, "");
-        std::copy(std::sregex_token_iterator(tmp.begin(), tmp.end(), re_spaces, -1),
-                  std::sregex_token_iterator(),
-                  std::back_inserter(replaces_list));
-        for (size_t i = 0; i + 1 < replaces_list.size(); i += 2)
-            replaces.push_back(std::make_tuple(replaces_list[i], replaces_list[i + 1]));
-
-        // Strip comments; if comment starts with "debug" then whole line is stripped
-        static std::regex re_comment("(^.*-- *debug| *--).*");
-        line = std::regex_replace(line, re_comment, "");
-
-        // Ignore empty lines
-        static std::regex re_empty("^ *$");
-        if (std::regex_match(line, re_empty))
-            continue;
-
-        // Protect lines that contain +=, -= etc.
-        static std::regex re_compound(".*[-+*/%]=.*");
-        line = std::regex_replace(line, re_compound, "X $0 X");
-
-        result += result.empty() ? line : " " + line;
+        std::ifstream file(cache_file, std::ios::binary);
+        cached.load(file);
     }
+    cache *store = cache_file ? &cached : nullptr;
 
-    // Rename all variables according to our rules
-    for (auto & rep : replaces)
-        result = std::regex_replace(result, std::regex("([^a-z_])(" + std::get<0>(rep) + ")([^a-z0-9_])"), "$1" + std::get<1>(rep) + "$3");
-
-    // Strip multiple spaces
-    result = std::regex_replace(result, re_spaces, " ");
+    // A .p8 cart has its code in the __lua__ section; anything else is
+    // taken as plain Lua code
+    cart c;
+    bool const is_cart = c.parse(input);
+    if (!is_cart && whole_cart)
+    {
+        std::cerr << "minify: input is not a PICO-8 cart\n";
+        return EXIT_FAILURE;
+    }
 
-    // Exploit Lua parsing rules
-    result = std::regex_replace(result, std::regex("0 ([g-wyz])"), "0$1");
-    result = std::regex_replace(result, std::regex("([1-9]) ([g-z])"), "$1$2");
+    cart::section *lua = is_cart ? c.find("lua") : nullptr;
+    if (is_cart && !lua)
+        lua = &c.add("lua");
 
-    // Unprotect lines protected with X
-    result = std::regex_replace(result, std::regex(" *X[ X]*"), " ");
+    // A feature that no line is tagged with is most likely a typo
+    auto const tags = find_tags(is_cart ? lua->text : input);
+    for (auto const &name : features)
+        if (!tags.count(name))
+            std::cerr << "minify: warning: no line is tagged with feature " << name << "\n";
+    auto m = is_cart ? minify(lua->text, lua->line, features, search, store)
+                     : minify(input, 1, features, search, store);
+    std::string code = m.str() + "\n";
 
-    // Remove spaces before and after symbols
-    result = std::regex_replace(result, std::regex(" *([[\\]\\\\<>(){}&|#+*%^/=:!~,-]) *"), "$1");
+    if (cache_file)
+    {
+        std::ofstream file(cache_file, std::ios::binary);
+        cached.save(file);
+    }
 
-    std::cout << result << "\n";
+    // With --stats, print the budget of the code instead of the code
+    if (print_stats)
+        std::cout << stats(m) << "\n";
+    // With --cart, print the whole cart with its other sections unchanged
+    else if (whole_cart)
+    {
+        lua->text = code;
+        std::cout << c.str();
+    }
+    else
+        std::cout << code;
 }
-
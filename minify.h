@@ -0,0 +1,1459 @@
+//
+// PICO-8 Lua minifier, shared by minify and p8z
+//
+
+#pragma once
+
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <cmath>
+
+#include "p8z.h"
+
+
+// A PICO-8 Lua token; comments are kept because they carry the minifier
+// annotations and the variant tags
+struct token
+{
+    enum kind_t { name, number, string, symbol, comment };
+
+    kind_t kind;
+    std::string text;
+    int line;
+};
+
+inline bool is_name_start(char ch)
+{
+    return isalpha((uint8_t)ch) || ch == '_' || (uint8_t)ch >= 0x80;
+}
+
+inline bool is_name_char(char ch)
+{
+    return is_name_start(ch) || isdigit((uint8_t)ch);
+}
+
+// Length of the long bracket ([[, [=[, [==[…) at position i, or 0
+inline size_t long_bracket(std::string const &s, size_t i)
+{
+    if (i >= s.size() || s[i] != '[')
+        return 0;
+    size_t j = i + 1;
+    while (j < s.size() && s[j] == '=')
+        ++j;
+    return j < s.size() && s[j] == '[' ? j + 1 - i : 0;
+}
+
+// Split PICO-8 Lua source into tokens in a single pass; line is the number
+// of the first line
+inline std::vector<token> lex(std::string const &src, int line = 1)
+{
+    // Longest operators first, so that the first match is the right one
+    static char const *operators[] =
+    {
+        ">>>=", "<<>=", ">><=", "...", "..=", ">>>", "<<>", ">><", "<<=", ">>=",
+        "^^=", "..", "<<", ">>", "^^", "==", "~=", "!=", "<=", ">=", "+=", "-=",
+        "*=", "/=", "\\=", "%=", "^=", "&=", "|=", "::",
+    };
+
+    std::vector<token> tokens;
+
+    for (size_t i = 0; i < src.size(); )
+    {
+        size_t start = i;
+        char ch = src[i];
+        token::kind_t kind;
+
+        if (isspace((uint8_t)ch))
+        {
+            line += ch == '\n';
+            ++i;
+            continue;
+        }
+
+        if ((ch == '-' || ch == '/') && i + 1 < src.size() && src[i + 1] == ch)
+        {
+            // Comments, including --[[ ]] long comments
+            kind = token::comment;
+            size_t n = ch == '-' ? long_bracket(src, i + 2) : 0;
+            i = n ? src.find("]" + std::string(n - 2, '=') + "]", i + 2 + n)
+                  : src.find('\n', i);
+            i = i == std::string::npos ? src.size() : n ? i + n : i;
+        }
+        else if (ch == '"' || ch == '\'')
+        {
+            kind = token::string;
+            for (++i; i < src.size() && src[i] != ch && src[i] != '\n'; ++i)
+                i += src[i] == '\\';
+            i = std::min(i + 1, src.size());
+        }
+        else if (size_t n = long_bracket(src, i))
+        {
+            kind = token::string;
+            i = src.find("]" + std::string(n - 2, '=') + "]", i + n);
+            i = i == std::string::npos ? src.size() : i + n;
+        }
+        else if (isdigit((uint8_t)ch) || (ch == '.' && isdigit((uint8_t)src[i + 1])))
+        {
+            // Decimal, hexadecimal and binary numbers, all with an optional
+            // fractional part; ".." after a number is the concat operator
+            kind = token::number;
+            bool hex = ch == '0' && strchr("xXbB", src[i + 1]) && src[i + 1];
+            for (i += hex ? 2 : 1; i < src.size(); ++i)
+                if (!(hex ? isxdigit((uint8_t)src[i]) : isdigit((uint8_t)src[i]))
+                     && (src[i] != '.' || src[i + 1] == '.'))
+                    break;
+        }
+        else if (is_name_start(ch))
+        {
+            kind = token::name;
+            while (i < src.size() && is_name_char(src[i]))
+                ++i;
+        }
+        else
+        {
+            kind = token::symbol;
+            ++i;
+            for (auto op : operators)
+                if (src.compare(start, strlen(op), op) == 0)
+                {
+                    i = start + strlen(op);
+                    break;
+                }
+        }
+
+        tokens.push_back(token{ kind, src.substr(start, i - start), line });
+        for (size_t j = start; j < i; ++j)
+            line += src[j] == '\n';
+    }
+
+    return tokens;
+}
+
+// Whether a comment ends with variant tags such as "-- +fast -poke"; the
+// tags are stored in the keep and drop sets
+inline bool parse_tags(std::string const &s, std::set<std::string> &keep,
+                       std::set<std::string> &drop)
+{
+    // Try every "--" from the end, like a greedy ".*-- *(tags)$" would
+    for (size_t p = s.size(); p >= 2; --p)
+    {
+        if (s.compare(p - 2, 2, "--") != 0)
+            continue;
+
+        std::set<std::string> plus, minus;
+        size_t i = p;
+        while (i < s.size() && s[i] == ' ')
+            ++i;
+        while (i + 1 < s.size() && (s[i] == '+' || s[i] == '-')
+                && (islower((uint8_t)s[i + 1]) || s[i + 1] == '_'))
+        {
+            size_t j = i + 1;
+            while (j < s.size() && (islower((uint8_t)s[j]) || s[j] == '_'))
+                ++j;
+            (s[i] == '+' ? plus : minus).insert(s.substr(i + 1, j - i - 1));
+            for (i = j; i < s.size() && s[i] == ' '; )
+                ++i;
+        }
+
+        if (i == s.size() && (plus.size() || minus.size()))
+        {
+            keep = plus;
+            drop = minus;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Feature names used by the variant tags of the code; this only looks at
+// lines, so a "--" in a string may be taken for a comment
+inline std::set<std::string> find_tags(std::string const &lua)
+{
+    std::set<std::string> ret;
+    for (size_t i = lua.find("--"); i != std::string::npos; i = lua.find("--", i))
+    {
+        size_t end = std::min(lua.find('\n', i), lua.size());
+        std::set<std::string> keep, drop;
+        if (parse_tags(lua.substr(i, end - i), keep, drop))
+        {
+            ret.insert(keep.begin(), keep.end());
+            ret.insert(drop.begin(), drop.end());
+        }
+        i = end;
+    }
+    return ret;
+}
+
+// Compound assignments such as +=; PICO-8 reads everything up to the end
+// of the line as their right-hand side
+inline bool is_compound(token const &t)
+{
+    return t.kind == token::symbol && t.text.size() > 1 && t.text.back() == '='
+        && t.text != "==" && t.text != "~=" && t.text != "!=" && t.text != "<="
+        && t.text != ">=";
+}
+
+inline bool is_keyword(std::string const &s)
+{
+    static std::set<std::string> const keywords =
+    {
+        "and", "break", "do", "else", "elseif", "end", "false", "for", "function",
+        "goto", "if", "in", "local", "nil", "not", "or", "repeat", "return",
+        "then", "true", "until", "while",
+    };
+    return keywords.count(s) > 0;
+}
+
+// Whether token i is the given keyword or symbol
+inline bool is(std::vector<token> const &code, size_t i, char const *text)
+{
+    return i < code.size() && code[i].kind != token::string
+            && code[i].kind != token::number && code[i].text == text;
+}
+
+// PICO-8 shorthand "if (cond) statement" and "while (cond) statement"
+// lines have no then or do, and no end: they end with the line
+inline bool is_shorthand(std::vector<token> const &code, size_t i)
+{
+    char const *word = is(code, i, "while") ? "do" : "then";
+    if (!is(code, i + 1, "("))
+        return false;
+    for (size_t j = i + 1; j < code.size() && code[j].line == code[i].line; ++j)
+        if (is(code, j, word))
+            return false;
+    return true;
+}
+
+// Index of the token after the matching closing bracket or block end
+inline size_t skip_block(std::vector<token> const &code, size_t i)
+{
+    int depth = 0;
+    for (; i < code.size(); ++i)
+    {
+        auto const &s = code[i].text;
+        if (code[i].kind == token::symbol)
+            depth += (s == "(" || s == "[" || s == "{") - (s == ")" || s == "]" || s == "}");
+        else if (code[i].kind == token::name)
+            depth += (s == "function" || s == "do" || s == "repeat"
+                       || (s == "if" && !is_shorthand(code, i)))
+                   - (s == "end" || s == "until");
+        if (depth <= 0)
+            return i + 1;
+    }
+    return i;
+}
+
+// Index of the token after the expression list starting at i
+inline size_t skip_expressions(std::vector<token> const &code, size_t i)
+{
+    static std::set<std::string> const unary = { "-", "not", "#", "~", "@", "%", "$" };
+    static std::set<std::string> const binary =
+    {
+        "+", "-", "*", "/", "\\", "%", "^", "..", "==", "~=", "!=", "<", ">",
+        "<=", ">=", "&", "|", "^^", "<<", ">>", ">>>", "<<>", ">><", "and", "or",
+    };
+
+    for (bool operand = true; i < code.size(); )
+    {
+        auto const &t = code[i];
+        if (operand)
+        {
+            if (t.kind != token::string && unary.count(t.text))
+                ++i;
+            else if (is(code, i, "(") || is(code, i, "{") || is(code, i, "function"))
+                i = skip_block(code, i), operand = false;
+            else if ((t.kind == token::name && !is_keyword(t.text))
+                      || t.kind == token::number || t.kind == token::string
+                      || is(code, i, "...") || is(code, i, "nil")
+                      || is(code, i, "true") || is(code, i, "false"))
+                ++i, operand = false;
+            else
+                break;
+        }
+        else if (is(code, i, ".") || is(code, i, ":"))
+            i += 2;
+        else if (is(code, i, "(") || is(code, i, "[") || is(code, i, "{"))
+            i = skip_block(code, i);
+        else if (t.kind == token::string)
+            ++i;
+        else if (t.kind != token::string && (binary.count(t.text) || t.text == ","))
+            ++i, operand = true;
+        else
+            break;
+    }
+
+    return i;
+}
+
+// Find the function each token belongs to; function 0 is the whole file,
+// and parent[] tells which function each function is nested in. Lua blocks
+// are opened by function, do, if and repeat, and closed by end and until.
+// A function starts at its parameter list, so that its name belongs to its
+// parent.
+inline std::vector<int> find_functions(std::vector<token> const &code,
+                                       std::vector<int> &parent)
+{
+    std::vector<int> owner(code.size());
+    std::vector<int> blocks;
+    int current = 0, pending = -1;
+    parent.assign(1, -1);
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (is(code, i, "function"))
+        {
+            blocks.push_back(current);
+            pending = (int)parent.size();
+            parent.push_back(current);
+        }
+        else if (is(code, i, "(") && pending >= 0)
+        {
+            current = pending;
+            pending = -1;
+        }
+        else if (is(code, i, "do") || is(code, i, "repeat")
+                  || (is(code, i, "if") && !is_shorthand(code, i)))
+            blocks.push_back(current);
+        else if ((is(code, i, "end") || is(code, i, "until")) && blocks.size())
+        {
+            current = blocks.back();
+            blocks.pop_back();
+        }
+        owner[i] = current;
+    }
+
+    return owner;
+}
+
+// A local variable: the tokens where it is visible, and the tokens that
+// refer to it, starting with its declaration
+struct variable
+{
+    std::string name;
+    size_t start, end;
+    std::vector<size_t> refs;
+    bool fixed; // implicit variables such as self cannot be renamed
+};
+
+// Resolve every name token to a local variable, following Lua scoping
+// rules; var_of[] is -1 for globals, table fields and keywords, and
+// globals[] lists where each global is used. Local variables become visible
+// after their whole declaration, so that "local a = a" works.
+struct scopes
+{
+    std::vector<variable> vars;
+    std::vector<int> var_of;
+    std::unordered_map<std::string, std::vector<size_t>> globals;
+};
+
+inline scopes analyze(std::vector<token> const &code)
+{
+    scopes s;
+    s.var_of.assign(code.size(), -1);
+
+    // Blocks list the variables they declare; shorthand if blocks end with
+    // their line
+    struct block { std::vector<int> vars; int line; };
+    std::vector<block> blocks(1, block{ {}, -1 });
+    std::unordered_map<std::string, std::vector<int>> visible;
+
+    // Declarations take effect at a later token: after the expressions of
+    // local statements, and inside the body of for loops; repeat blocks
+    // close after the expression of their until
+    struct pending { size_t at; std::vector<size_t> names; };
+    std::vector<pending> pendings;
+    std::vector<size_t> untils;
+    std::vector<bool> declared(code.size());
+    std::vector<char> brackets;
+    bool function = false, method = false;
+
+    auto declare = [&](std::string const &name, size_t start, size_t tok)
+    {
+        s.vars.push_back(variable{ name, start, code.size(), {}, tok == code.size() });
+        if (tok < code.size())
+        {
+            s.vars.back().refs.push_back(tok);
+            s.var_of[tok] = (int)s.vars.size() - 1;
+        }
+        visible[name].push_back((int)s.vars.size() - 1);
+        blocks.back().vars.push_back((int)s.vars.size() - 1);
+    };
+
+    auto close = [&](size_t i)
+    {
+        for (auto v = blocks.back().vars.rbegin(); v != blocks.back().vars.rend(); ++v)
+        {
+            s.vars[*v].end = i;
+            visible[s.vars[*v].name].pop_back();
+        }
+        blocks.pop_back();
+    };
+
+    // Names in a list such as "a, b, c" starting at i; returns the index
+    // after the list
+    auto names = [&](size_t i, std::vector<size_t> &list)
+    {
+        for (; i < code.size() && code[i].kind == token::name; i += 2)
+        {
+            list.push_back(i);
+            declared[i] = true;
+            if (!is(code, i + 1, ","))
+                return i + 1;
+        }
+        return i;
+    };
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto const &t = code[i];
+
+        while (blocks.size() > 1 && blocks.back().line >= 0 && blocks.back().line != t.line)
+            close(i);
+        for (; pendings.size() && pendings.back().at == i; pendings.pop_back())
+            for (auto n : pendings.back().names)
+                declare(code[n].text, i, n);
+        for (; untils.size() && untils.back() == i; untils.pop_back())
+            close(i);
+
+        if (t.kind == token::symbol)
+        {
+            if (t.text == "(" && function)
+            {
+                // Function parameters are visible in the whole body
+                blocks.push_back(block{ {}, -1 });
+                if (method)
+                    declare("self", i, code.size());
+                std::vector<size_t> params;
+                names(i + 1, params);
+                for (auto n : params)
+                    declare(code[n].text, i, n);
+                function = method = false;
+            }
+            else if (t.text == ":" && function)
+                method = true;
+
+            if (t.text == "(" || t.text == "[" || t.text == "{")
+                brackets.push_back(t.text[0]);
+            else if ((t.text == ")" || t.text == "]" || t.text == "}") && brackets.size())
+                brackets.pop_back();
+            continue;
+        }
+
+        if (t.kind != token::name || declared[i])
+            continue;
+
+        if (t.text == "local" && is(code, i + 1, "function"))
+        {
+            // The function can call itself, so it is visible in its body
+            declared[i + 2] = true;
+            declare(code[i + 2].text, i + 2, i + 2);
+        }
+        else if (t.text == "local")
+        {
+            std::vector<size_t> list;
+            size_t j = names(i + 1, list);
+            pendings.push_back(pending{ is(code, j, "=") ? skip_expressions(code, j + 1) : j, list });
+        }
+        else if (t.text == "for")
+        {
+            std::vector<size_t> list;
+            size_t j = skip_expressions(code, names(i + 1, list) + 1);
+            pendings.push_back(pending{ j + 1, list });
+        }
+        else if (t.text == "function")
+            function = true;
+        else if (t.text == "do" || t.text == "then" || t.text == "repeat")
+            blocks.push_back(block{ {}, -1 });
+        else if (t.text == "if" && is_shorthand(code, i))
+            blocks.push_back(block{ {}, t.line });
+        else if ((t.text == "end" || t.text == "elseif") && blocks.size() > 1)
+            close(i);
+        else if (t.text == "else" && blocks.size() > 1 && blocks.back().line < 0)
+        {
+            close(i);
+            blocks.push_back(block{ {}, -1 });
+        }
+        else if (t.text == "until")
+            untils.push_back(skip_expressions(code, i + 1));
+        else if (t.text == "goto")
+            ++i;
+        else if (is_keyword(t.text))
+            continue;
+        else if (i > 0 && (is(code, i - 1, ".") || is(code, i - 1, ":")
+                            || is(code, i - 1, "::")))
+            continue;
+        else if (brackets.size() && brackets.back() == '{' && is(code, i + 1, "=")
+                  && (is(code, i - 1, "{") || is(code, i - 1, ",") || is(code, i - 1, ";")))
+            continue;
+        else if (visible[t.text].size())
+        {
+            s.var_of[i] = visible[t.text].back();
+            s.vars[s.var_of[i]].refs.push_back(i);
+        }
+        else
+            s.globals[t.text].push_back(i);
+    }
+
+    while (blocks.size() > 1)
+        close(code.size());
+    return s;
+}
+
+// Whether some use of variable a would be shadowed by variable b if they
+// had the same name
+inline bool is_shadowed(variable const &a, variable const &b)
+{
+    auto it = std::lower_bound(a.refs.begin(), a.refs.end(), b.start);
+    return it != a.refs.end() && *it < b.end;
+}
+
+// Whether two variables cannot have the same name, because the one that is
+// declared last would shadow some use of the other
+inline bool conflicts(variable const &a, variable const &b)
+{
+    bool later = std::make_pair(a.start, a.refs.size() ? a.refs[0] : 0)
+               > std::make_pair(b.start, b.refs.size() ? b.refs[0] : 0);
+    return later ? is_shadowed(b, a) : is_shadowed(a, b);
+}
+
+// Replace code[begin, end) with tokens; the comments inside the range go
+// away with it, and the ones after it follow the code
+inline void splice(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes,
+                   size_t begin, size_t end, std::vector<token> const &tokens = {})
+{
+    code.erase(code.begin() + begin, code.begin() + end);
+    code.insert(code.begin() + begin, tokens.begin(), tokens.end());
+    std::vector<std::pair<size_t, token>> kept;
+    for (auto const &note : notes)
+        if (note.first <= begin)
+            kept.push_back(note);
+        else if (note.first >= end)
+            kept.push_back(std::make_pair(note.first - (end - begin) + tokens.size(), note.second));
+    notes.swap(kept);
+}
+
+// Value of an integer literal that PICO-8 reads exactly; hexadecimal and
+// binary ones wrap around to negative numbers above 0x7fff
+inline bool integer_value(token const &t, long &value)
+{
+    if (t.kind != token::number || t.text.find('.') != std::string::npos)
+        return false;
+    bool const prefix = t.text.size() > 2 && strchr("xXbB", t.text[1]);
+    int const base = prefix ? (t.text[1] | 0x20) == 'x' ? 16 : 2 : 10;
+    long ret = 0;
+    for (size_t i = prefix ? 2 : 0; i < t.text.size(); ++i)
+    {
+        ret = ret * base + (isdigit((uint8_t)t.text[i]) ? t.text[i] - '0'
+                                                         : (t.text[i] | 0x20) - 'a' + 10);
+        if (ret > (base == 10 ? 0x7fff : 0xffff))
+            return false;
+    }
+    value = ret > 0x7fff ? ret - 0x10000 : ret;
+    return true;
+}
+
+// Precedence of binary operators, from or to ^; 0 for other tokens
+inline int precedence(token const &t)
+{
+    static std::unordered_map<std::string, int> const table =
+    {
+        { "or", 1 }, { "and", 2 },
+        { "<", 3 }, { ">", 3 }, { "<=", 3 }, { ">=", 3 }, { "~=", 3 }, { "!=", 3 }, { "==", 3 },
+        { "|", 4 }, { "^^", 5 }, { "&", 6 },
+        { "<<", 7 }, { ">>", 7 }, { ">>>", 7 }, { "<<>", 7 }, { ">><", 7 },
+        { "..", 8 }, { "+", 9 }, { "-", 9 }, { "*", 10 }, { "/", 10 }, { "\\", 10 }, { "%", 10 },
+        { "^", 12 },
+    };
+    if (t.kind == token::string || t.kind == token::number)
+        return 0;
+    auto it = table.find(t.text);
+    return it == table.end() ? 0 : it->second;
+}
+
+// Whether token i ends an operand, so that a "-" after it is binary
+inline bool ends_operand(std::vector<token> const &code, size_t i)
+{
+    auto const &t = code[i];
+    return t.kind == token::number || t.kind == token::string
+        || (t.kind == token::name && (!is_keyword(t.text) || t.text == "nil"
+                                      || t.text == "true" || t.text == "false"))
+        || is(code, i, ")") || is(code, i, "]") || is(code, i, "}") || is(code, i, "...");
+}
+
+// Compute a op b the way PICO-8 does, when the result is an integer
+inline bool fold(std::string const &op, long a, long b, long &ret)
+{
+    if (op == "+") ret = a + b;
+    else if (op == "-") ret = a - b;
+    else if (op == "*") ret = a * b;
+    else if (op == "/" && b && a % b == 0) ret = a / b;
+    else if (op == "\\" && b) ret = (long)std::floor((double)a / b);
+    else if (op == "%" && b > 0) ret = a - (long)std::floor((double)a / b) * b;
+    else if (op == "&") ret = a & b;
+    else if (op == "|") ret = a | b;
+    else if (op == "^^") ret = a ^ b;
+    else if (op == "<<" && b >= 0 && b < 16) ret = a * (1l << b);
+    else if ((op == ">>" || (op == ">>>" && a >= 0)) && b >= 0 && b < 16 && a % (1l << b) == 0)
+        ret = a / (1l << b);
+    else
+        return false;
+    return ret >= -0x7fff && ret <= 0x7fff;
+}
+
+// Fold operations on integer literals, such as "2 * 8" or "1 << 4", when
+// the operators around them do not bind tighter
+inline bool fold_constants(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes)
+{
+    bool changed = false;
+    for (size_t k = 1; k + 1 < code.size(); ++k)
+    {
+        int const prec = precedence(code[k]);
+        if (prec < 4 || prec > 10 || code[k].text == "..")
+            continue;
+
+        // Operands are literals, possibly negated by a unary minus
+        long a, b, ret;
+        size_t l = k - 1, r = k + 2;
+        if (!integer_value(code[l], a))
+            continue;
+        if (l > 0 && is(code, l - 1, "-") && (l == 1 || !ends_operand(code, l - 2)))
+            --l, a = -a;
+        if (is(code, k + 1, "-") && r < code.size() && integer_value(code[r], b))
+            ++r, b = -b;
+        else if (!integer_value(code[k + 1], b))
+            continue;
+
+        // Nothing on the left may take the left operand, and nothing on the
+        // right may take the right one
+        if (l > 0 && (precedence(code[l - 1]) >= prec
+                       || is(code, l - 1, "not") || is(code, l - 1, "#") || is(code, l - 1, "~")
+                       || is(code, l - 1, "@") || is(code, l - 1, "$")
+                       || ((is(code, l - 1, "-") || is(code, l - 1, "%"))
+                            && (l == 1 || !ends_operand(code, l - 2)))))
+            continue;
+        if (r < code.size() && precedence(code[r]) > prec)
+            continue;
+        if (!fold(code[k].text, a, b, ret))
+            continue;
+
+        int const line = code[l].line;
+        std::vector<token> result;
+        if (ret < 0)
+            result.push_back(token{ token::symbol, "-", line });
+        result.push_back(token{ token::number, std::to_string(std::labs(ret)), line });
+        splice(code, notes, l, r, result);
+        k = l;
+        changed = true;
+    }
+    return changed;
+}
+
+// Whether a condition made of tokens [begin, end) is a literal, possibly
+// negated: 1 if it is true, 0 if it is false or nil, -1 otherwise
+inline int truth(std::vector<token> const &code, size_t begin, size_t end)
+{
+    if (end >= begin + 3 && is(code, begin, "(") && is(code, end - 1, ")"))
+        ++begin, --end;
+    if (end == begin + 2 && is(code, begin, "not"))
+    {
+        int ret = truth(code, begin + 1, end);
+        return ret < 0 ? ret : 1 - ret;
+    }
+    if (end != begin + 1)
+        return -1;
+    if (is(code, begin, "false") || is(code, begin, "nil"))
+        return 0;
+    return code[begin].kind == token::number || code[begin].kind == token::string
+        || is(code, begin, "true") ? 1 : -1;
+}
+
+// Whether a block needs its own scope: it declares locals or labels, or it
+// returns, which must be the last statement of a block
+inline bool needs_scope(std::vector<token> const &code, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; )
+    {
+        if (is(code, i, "local") || is(code, i, "::") || is(code, i, "return"))
+            return true;
+        bool const opens = is(code, i, "function") || is(code, i, "do") || is(code, i, "repeat")
+                        || is(code, i, "(") || is(code, i, "[") || is(code, i, "{")
+                        || (is(code, i, "if") && !is_shorthand(code, i));
+        i = opens ? skip_block(code, i) : i + 1;
+    }
+    return false;
+}
+
+// Drop the branches of if statements whose condition is a literal, and
+// while loops that never run; a single branch that is always taken loses
+// its if, and only keeps a do … end if it needs a scope
+inline bool prune_branches(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes)
+{
+    bool changed = false;
+    for (size_t i = code.size(); i-- > 0; )
+    {
+        if (is(code, i, "while"))
+        {
+            size_t j = skip_expressions(code, i + 1);
+            if (is(code, j, "do") && truth(code, i + 1, j) == 0)
+            {
+                splice(code, notes, i, skip_block(code, j));
+                changed = true;
+            }
+            continue;
+        }
+
+        if (!is(code, i, "if") || is_shorthand(code, i))
+            continue;
+
+        // Find the if, elseif and else branches, and the end
+        struct branch { size_t at, body; int value; };
+        std::vector<branch> branches(1, branch{ i, 0, -1 });
+        size_t end = code.size();
+        for (size_t j = i + 1; j < code.size(); )
+        {
+            if (is(code, j, "then"))
+            {
+                branches.back().body = j + 1;
+                branches.back().value = truth(code, branches.back().at + 1, j);
+                ++j;
+            }
+            else if (is(code, j, "elseif") || is(code, j, "else"))
+            {
+                branches.push_back(branch{ j, j + 1, is(code, j, "else") ? 1 : -1 });
+                ++j;
+            }
+            else if (is(code, j, "end"))
+            {
+                end = j;
+                break;
+            }
+            else if (is(code, j, "if") && is_shorthand(code, j))
+            {
+                // Shorthand if lines may have their own else
+                for (int line = code[j].line; j < code.size() && code[j].line == line; )
+                    ++j;
+            }
+            else if (is(code, j, "function") || is(code, j, "do") || is(code, j, "repeat")
+                      || is(code, j, "(") || is(code, j, "[") || is(code, j, "{")
+                      || is(code, j, "if"))
+                j = skip_block(code, j);
+            else
+                ++j;
+        }
+        if (end == code.size())
+            continue;
+
+        // Branches after one that is always taken are never reached
+        size_t last = 0;
+        while (last + 1 < branches.size() && branches[last].value != 1)
+            ++last;
+        std::vector<size_t> kept;
+        for (size_t k = 0; k <= last; ++k)
+            if (branches[k].value != 0)
+                kept.push_back(k);
+        bool const taken = branches[last].value == 1;
+        bool const is_else = is(code, branches[last].at, "else");
+        if (kept.size() == last + 1 && last + 1 == branches.size() && (!taken || is_else))
+            continue;
+
+        // Edit from the end, so that the positions before stay valid
+        auto next = [&](size_t k) { return k + 1 < branches.size() ? branches[k + 1].at : end; };
+        if (kept.empty())
+            splice(code, notes, i, end + 1);
+        else if (kept.size() == 1 && taken)
+        {
+            auto const &b = branches[kept[0]];
+            bool const scope = needs_scope(code, b.body, next(kept[0]));
+            splice(code, notes, next(kept[0]), end + 1,
+                   scope ? std::vector<token>{ code[end] } : std::vector<token>{});
+            splice(code, notes, b.at, b.body, scope ? std::vector<token>{ token{ token::name, "do", code[b.at].line } }
+                                                    : std::vector<token>{});
+            splice(code, notes, i, b.at);
+        }
+        else
+        {
+            splice(code, notes, next(last), end);
+            if (taken && !is_else)
+                splice(code, notes, branches[last].at, branches[last].body,
+                       { token{ token::name, "else", code[branches[last].at].line } });
+            for (size_t k = last + 1; k-- > 0; )
+                if (branches[k].value == 0)
+                    splice(code, notes, branches[k].at, next(k));
+            code[i].text = "if";
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// Replace locals that are set once to true, false or nil, such as debug
+// flags, with their value, so that the branches they guard can be pruned
+inline bool propagate_constants(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes)
+{
+    auto s = analyze(code);
+    std::vector<size_t> declarations;
+    for (auto const &v : s.vars)
+    {
+        size_t d = v.refs.size() ? v.refs[0] : 0;
+        if (!d || !is(code, d - 1, "local") || !is(code, d + 1, "=")
+             || !(is(code, d + 2, "true") || is(code, d + 2, "false") || is(code, d + 2, "nil"))
+             || skip_expressions(code, d + 2) != d + 3 || is(code, d + 3, ","))
+            continue;
+
+        // Any use that may assign the variable or index it disqualifies it
+        bool constant = true;
+        for (size_t n = 1; n < v.refs.size() && constant; ++n)
+        {
+            size_t j = v.refs[n] + 1;
+            constant = j == code.size() || code[j].kind == token::name
+                    || (code[j].kind == token::symbol && !is_compound(code[j])
+                         && !strchr("=,.:([{", code[j].text[0]));
+        }
+        if (!constant)
+            continue;
+
+        for (size_t n = 1; n < v.refs.size(); ++n)
+            code[v.refs[n]].text = code[d + 2].text;
+        declarations.push_back(d - 1);
+    }
+
+    std::sort(declarations.rbegin(), declarations.rend());
+    for (size_t d : declarations)
+        splice(code, notes, d, d + 4);
+    return declarations.size() > 0;
+}
+
+// Remove local functions that are only used in their own body
+inline bool remove_unused_functions(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes)
+{
+    auto s = analyze(code);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (auto const &v : s.vars)
+    {
+        size_t d = v.refs.size() ? v.refs[0] : 0, begin, end;
+        if (d >= 2 && is(code, d - 1, "function") && is(code, d - 2, "local"))
+            begin = d - 2, end = skip_block(code, d - 1);
+        else if (d && is(code, d - 1, "local") && is(code, d + 1, "=") && is(code, d + 2, "function")
+                  && skip_expressions(code, d + 2) == skip_block(code, d + 2))
+            begin = d - 1, end = skip_block(code, d + 2);
+        else
+            continue;
+
+        if (std::all_of(v.refs.begin(), v.refs.end(),
+                        [&](size_t n) { return n >= begin && n < end; }))
+            ranges.push_back(std::make_pair(begin, end));
+    }
+
+    // Nested functions go away with the outer one
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<size_t, size_t>> outer;
+    for (auto const &r : ranges)
+        if (outer.empty() || r.first >= outer.back().second)
+            outer.push_back(r);
+    for (auto r = outer.rbegin(); r != outer.rend(); ++r)
+        splice(code, notes, r->first, r->second);
+    return outer.size() > 0;
+}
+
+// Simplify the code before renaming, until nothing changes
+inline void simplify(std::vector<token> &code, std::vector<std::pair<size_t, token>> &notes)
+{
+    for (bool changed = true; changed; )
+    {
+        changed = fold_constants(code, notes);
+        changed |= propagate_constants(code, notes);
+        changed |= prune_branches(code, notes);
+        changed |= remove_unused_functions(code, notes);
+    }
+}
+
+// Rename names according to the "replaces:" annotations, then give the
+// remaining long local names the shortest names that are free over their
+// whole lifetime. An annotation applies to the whole function it appears
+// in, including nested functions that do not have their own annotation for
+// the same name. notes[] are the comments, with the index of the token
+// they come before.
+inline void rename(std::vector<token> &code,
+                   std::vector<std::pair<size_t, token>> const &notes,
+                   std::function<size_t(std::vector<token> const &)> const &score)
+{
+    std::vector<int> parent;
+    auto owner = find_functions(code, parent);
+    std::vector<std::unordered_map<std::string, std::string>> replaces(parent.size());
+    auto s = analyze(code);
+
+    // Parse special comments indicating possible replacements, and check
+    // that "can reuse:" hints do not list variables that are used later
+    for (auto const &note : notes)
+    {
+        auto const &text = note.second.text;
+        auto pos = text.find("] replaces: ");
+        auto hint = text.find("] can reuse: ");
+        if (pos == std::string::npos && hint == std::string::npos)
+            continue;
+
+        std::vector<std::string> names;
+        for (size_t i = text.find(": ") + 2, j; i < text.size(); i = j)
+        {
+            i = std::min(text.find_first_not_of(' ', i), text.size());
+            j = std::min(text.find(' ', i), text.size());
+            if (j > i)
+                names.push_back(text.substr(i, j - i));
+        }
+
+        int f = note.first > 0 ? owner[note.first - 1] : 0;
+        for (size_t i = 0; pos != std::string::npos && i + 1 < names.size(); i += 2)
+            replaces[f].emplace(names[i], names[i + 1]);
+
+        for (size_t i = 0; hint != std::string::npos && i < names.size(); i += 2)
+            for (auto const &v : s.vars)
+                if (v.name == names[i] && v.start < note.first && note.first < v.end
+                     && v.refs.back() >= note.first)
+                    std::cerr << "minify: line " << note.second.line << ": "
+                              << v.name << " is still used on line "
+                              << code[v.refs.back()].line << "\n";
+    }
+
+    // Look up a name in its function, then in the enclosing ones
+    auto lookup = [&](size_t n) -> std::string const &
+    {
+        for (int f = owner[n]; f >= 0; f = parent[f])
+        {
+            auto it = replaces[f].find(code[n].text);
+            if (it != replaces[f].end())
+                return it->second;
+        }
+        return code[n].text;
+    };
+
+    // Globals and table fields are only renamed by annotations
+    std::unordered_map<std::string, std::vector<size_t>> globals;
+    std::unordered_map<std::string, size_t> uses;
+    for (size_t n = 0; n < code.size(); ++n)
+    {
+        if (code[n].kind != token::name || s.var_of[n] >= 0)
+            continue;
+        if (s.globals.count(code[n].text))
+            globals[lookup(n)].push_back(n);
+        code[n].text = lookup(n);
+        ++uses[code[n].text];
+    }
+
+    // Local variables keep the name given by an annotation, or their own
+    // name if it only has one character
+    std::unordered_map<std::string, std::vector<int>> owners;
+    std::vector<int> todo;
+    for (int v = 0; v < (int)s.vars.size(); ++v)
+    {
+        auto &var = s.vars[v];
+        if (!var.fixed)
+        {
+            auto const &name = lookup(var.refs[0]);
+            if (name == var.name && name.size() > 1)
+            {
+                todo.push_back(v);
+                continue;
+            }
+            var.name = name;
+        }
+        owners[var.name].push_back(v);
+        uses[var.name] += var.refs.size();
+    }
+
+    // Whether a variable can be renamed; moved[] lists other variables that
+    // are renamed at the same time
+    auto is_free = [&](int v, std::string const &name,
+                       std::vector<std::pair<int, std::string>> const &moved)
+    {
+        auto is_moved = [&](int w)
+        {
+            return std::any_of(moved.begin(), moved.end(), [&](std::pair<int, std::string> const &m)
+                               { return m.first == w; });
+        };
+
+        auto const &g = globals[name];
+        auto it = std::lower_bound(g.begin(), g.end(), s.vars[v].start);
+        if (it != g.end() && *it < s.vars[v].end)
+            return false;
+        for (int w : owners[name])
+            if (w != v && !is_moved(w) && conflicts(s.vars[v], s.vars[w]))
+                return false;
+        for (auto const &m : moved)
+            if (m.first != v && m.second == name && conflicts(s.vars[v], s.vars[m.first]))
+                return false;
+        return true;
+    };
+
+    // Other variables get the most used name that is not in use anywhere
+    // in their lifetime, starting with the most used variables
+    std::vector<std::string> candidates;
+    for (char a = 'a'; a <= 'z'; ++a)
+        candidates.push_back(std::string(1, a));
+    for (char a = 'a'; a <= 'z'; ++a)
+        for (char b = 'a'; b <= 'z'; ++b)
+            if (!is_keyword(std::string{ a, b }))
+                candidates.push_back(std::string{ a, b });
+
+    std::stable_sort(todo.begin(), todo.end(), [&](int a, int b)
+                     { return s.vars[a].refs.size() > s.vars[b].refs.size(); });
+
+    for (int v : todo)
+    {
+        auto &var = s.vars[v];
+        std::string const *best = nullptr;
+        for (auto const &name : candidates)
+            if (!(best && (name.size() > best->size() || uses[name] <= uses[*best]))
+                 && is_free(v, name, {}))
+                best = &name;
+        var.name = best ? *best : var.name;
+        owners[var.name].push_back(v);
+        uses[var.name] += var.refs.size();
+    }
+
+    for (auto const &var : s.vars)
+        for (auto n : var.refs)
+            code[n].text = var.name;
+
+    if (!score)
+        return;
+
+    // Local search: try giving each variable every other one-letter name,
+    // then try swapping two one-letter names everywhere, and keep the best
+    // change of each batch if it compresses better; batches are scored on
+    // all CPU cores, and sweeps are repeated until nothing improves
+    typedef std::vector<std::pair<int, std::string>> move;
+    auto evaluate = [&](std::vector<move> const &moves)
+    {
+        std::vector<size_t> costs(moves.size());
+        std::atomic<size_t> next(0);
+        auto worker = [&]()
+        {
+            auto copy = code;
+            for (size_t i = next++; i < moves.size(); i = next++)
+            {
+                for (auto const &m : moves[i])
+                    for (auto n : s.vars[m.first].refs)
+                        copy[n].text = m.second;
+                costs[i] = score(copy);
+                for (auto const &m : moves[i])
+                    for (auto n : s.vars[m.first].refs)
+                        copy[n].text = s.vars[m.first].name;
+            }
+        };
+
+        std::vector<std::thread> threads(std::max(1u, std::thread::hardware_concurrency()));
+        for (auto &t : threads)
+            t = std::thread(worker);
+        for (auto &t : threads)
+            t.join();
+        return costs;
+    };
+
+    size_t initial = score(code), best = initial;
+    for (bool improved = true; improved; )
+    {
+        improved = false;
+        for (int v = 0; v <= (int)s.vars.size(); ++v)
+        {
+            std::vector<move> moves;
+            for (size_t c = 0; v < (int)s.vars.size() && c < 26 && !s.vars[v].fixed; ++c)
+                if (candidates[c] != s.vars[v].name && is_free(v, candidates[c], {}))
+                    moves.push_back({ std::make_pair(v, candidates[c]) });
+            for (size_t a = 0; v == (int)s.vars.size() && a < 26; ++a)
+                for (size_t b = a + 1; b < 26; ++b)
+                {
+                    move swap;
+                    for (size_t c : { a, b })
+                        for (int w : owners[candidates[c]])
+                            if (!s.vars[w].fixed)
+                                swap.push_back(std::make_pair(w, candidates[a + b - c]));
+                    bool valid = swap.size() > 0;
+                    for (auto const &m : swap)
+                        valid = valid && is_free(m.first, m.second, swap);
+                    if (valid)
+                        moves.push_back(swap);
+                }
+
+            // Ties go to the first move, so that the result is deterministic
+            auto costs = evaluate(moves);
+            auto it = std::min_element(costs.begin(), costs.end());
+            if (it == costs.end() || *it >= best)
+                continue;
+
+            best = *it;
+            improved = true;
+            for (auto const &m : moves[it - costs.begin()])
+            {
+                auto &list = owners[s.vars[m.first].name];
+                list.erase(std::find(list.begin(), list.end(), m.first));
+                s.vars[m.first].name = m.second;
+                for (auto n : s.vars[m.first].refs)
+                    code[n].text = m.second;
+            }
+            for (auto const &m : moves[it - costs.begin()])
+                owners[m.second].push_back(m.first);
+        }
+    }
+
+    std::cerr << "minify: compressed size " << initial << " -> " << best << " bytes\n";
+}
+
+// Whether two tokens can be written next to each other without a space
+inline bool can_join(token const &a, token const &b)
+{
+    // Names never merge with symbols or strings; only lex other pairs
+    if ((a.kind == token::name && (b.kind == token::symbol || b.kind == token::string))
+         || (a.kind == token::symbol && b.kind == token::name))
+        return true;
+    if ((a.kind == token::name || a.kind == token::number)
+         && (b.kind == token::name || b.kind == token::number))
+        return false;
+    // Lua reads "1..", "1.5.." or "0x1f.." as a malformed number
+    if (a.kind == token::number && b.text[0] == '.')
+        return false;
+
+    auto tokens = lex(a.text + b.text);
+    return tokens.size() == 2 && tokens[0].text == a.text && tokens[1].text == b.text;
+}
+
+// Join tokens, only keeping the spaces that are needed; compound[] lists
+// the lines that contain +=, -= etc.
+inline std::string join(std::vector<token> const &code, std::set<int> const &compound)
+{
+    std::string result;
+    int shorthand = -1; // line of the last shorthand if or while
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        auto const &t = code[i];
+        if (i > 0 && shorthand >= 0 && t.line != shorthand)
+        {
+            // The statement after a shorthand if or while must go on the
+            // next line, or it would become part of the conditional
+            result += '\n';
+            shorthand = -1;
+        }
+        else if (i > 0)
+        {
+            auto const &prev = code[i - 1];
+            char a = prev.text.back(), b = t.text[0];
+            bool space;
+
+            // Exploit Lua parsing rules: "0g" and "1g" are read as "0 g" and
+            // "1 g", except across lines with +=, -= etc.
+            if (prev.kind == token::number && t.kind == token::name)
+                space = (prev.line != t.line && (compound.count(prev.line)
+                                                 || compound.count(t.line)))
+                     || (a == '0' ? !strchr("ghijklmnopqrstuvwyz", b)
+                                  : !isdigit((uint8_t)a) || b < 'g' || b > 'z');
+            // Otherwise only keep a space if the two tokens would read
+            // differently without it, e.g. "a b", "- -" or "1 .."
+            else
+                space = !can_join(prev, t);
+
+            if (space)
+                result += ' ';
+        }
+        result += t.text;
+        if ((is(code, i, "if") || is(code, i, "while")) && is_shorthand(code, i))
+            shorthand = t.line;
+    }
+
+    return result;
+}
+
+// Minified code, kept as tokens for stats()
+struct minified
+{
+    std::vector<token> code;
+    std::set<int> compound; // lines that contain +=, -= etc.
+
+    std::string str() const { return join(code, compound); }
+};
+
+// The code of one part of the source, without the lines dropped by variant
+// tags and debug comments; comments are kept aside for rename(), with their
+// position in code
+struct part
+{
+    std::vector<token> code;
+    std::vector<std::pair<size_t, token>> notes;
+    std::set<int> compound; // lines that contain +=, -= etc.
+};
+
+inline part prepare(std::vector<token> const &tokens, std::set<std::string> const &features)
+{
+    // Find out which lines are kept, using their trailing comments
+    std::set<int> dropped;
+
+    for (auto const &t : tokens)
+    {
+        if (t.kind != token::comment)
+            continue;
+
+        // Select lines according to their variant tags; all of them must match
+        std::set<std::string> keep, drop;
+        if (parse_tags(t.text, keep, drop))
+        {
+            for (auto const &name : keep)
+                if (!features.count(name))
+                    dropped.insert(t.line);
+            for (auto const &name : drop)
+                if (features.count(name))
+                    dropped.insert(t.line);
+        }
+
+        // If comment starts with "debug" then whole line is stripped
+        for (size_t i = t.text.find("--"); i != std::string::npos; i = t.text.find("--", i + 1))
+        {
+            size_t j = t.text.find_first_not_of(' ', i + 2);
+            if (j != std::string::npos && t.text.compare(j, 5, "debug") == 0)
+                dropped.insert(t.line);
+        }
+    }
+
+    // Keep code from selected lines, and remember the lines that contain
+    // +=, -= etc.; comments are kept aside for rename()
+    part ret;
+    for (auto const &t : tokens)
+    {
+        if (dropped.count(t.line))
+            continue;
+        if (t.kind == token::comment)
+        {
+            ret.notes.push_back(std::make_pair(ret.code.size(), t));
+            continue;
+        }
+        if (is_compound(t))
+            ret.compound.insert(t.line);
+        ret.code.push_back(t);
+    }
+
+    return ret;
+
+}
+
+// Lexing cache for minify --cache: prepared parts of the code, keyed by a
+// hash of their text and of the features, with line numbers starting at 0.
+// Only the parts used by the last run are saved, so the file follows the
+// source.
+struct cache
+{
+    std::unordered_map<uint64_t, part> entries, used;
+
+    static uint64_t hash(std::string const &key, std::string const &text)
+    {
+        uint64_t ret = 0xcbf29ce484222325;
+        for (auto const &s : { key, text })
+            for (char ch : s)
+                ret = (ret ^ (uint8_t)ch) * 0x100000001b3;
+        return ret;
+    }
+
+    void load(std::istream &in)
+    {
+        auto read_token = [&](token &t)
+        {
+            int kind;
+            size_t len;
+            in >> kind >> t.line >> len;
+            in.get();
+            t.kind = (token::kind_t)kind;
+            t.text.resize(len);
+            in.read(&t.text[0], len);
+        };
+
+        std::string magic;
+        if (!std::getline(in, magic) || magic != "minify cache 1")
+            return;
+        uint64_t h;
+        size_t ncode, nnotes, ncompound;
+        while (in >> std::hex >> h >> std::dec >> ncode >> nnotes >> ncompound)
+        {
+            part p;
+            p.code.resize(ncode);
+            p.notes.resize(nnotes);
+            for (auto &t : p.code)
+                read_token(t);
+            for (auto &note : p.notes)
+            {
+                in >> note.first;
+                read_token(note.second);
+            }
+            for (size_t i = 0, line; i < ncompound && in >> line; ++i)
+                p.compound.insert((int)line);
+            if (!in)
+                break;
+            entries[h] = std::move(p);
+        }
+    }
+
+    void save(std::ostream &out) const
+    {
+        auto write_token = [&](token const &t)
+        {
+            out << (int)t.kind << ' ' << t.line << ' ' << t.text.size() << ' ' << t.text << '\n';
+        };
+
+        out << "minify cache 1\n";
+        for (auto const &e : used)
+        {
+            out << std::hex << e.first << std::dec << ' ' << e.second.code.size() << ' '
+                << e.second.notes.size() << ' ' << e.second.compound.size() << '\n';
+            for (auto const &t : e.second.code)
+                write_token(t);
+            for (auto const &note : e.second.notes)
+            {
+                out << note.first << ' ';
+                write_token(note.second);
+            }
+            for (int line : e.second.compound)
+                out << line << '\n';
+        }
+    }
+};
+
+// Minify the Lua code of a cart, keeping the variants given in features;
+// line is the line number of the first line, for warnings. With a cache,
+// each top-level function is prepared on its own and only the ones that
+// changed are lexed again; simplify(), rename() and join() still run on the
+// whole code, since they need to see all of it.
+inline minified minify(std::string const &lua, int line,
+                       std::set<std::string> const &features, bool search,
+                       cache *cached = nullptr)
+{
+    // Parts start on lines that begin with "function" or "local function"
+    std::vector<size_t> ends;
+    for (size_t i = 0; cached && i < lua.size(); i = lua.find('\n', i), i += i != std::string::npos)
+        if (i > 0 && (lua.compare(i, 9, "function ") == 0 || lua.compare(i, 15, "local function ") == 0))
+            ends.push_back(i);
+    ends.push_back(lua.size());
+
+    std::string key;
+    for (auto const &name : features)
+        key += name + ' ';
+
+    part all;
+    size_t begin = 0;
+    for (size_t end : ends)
+    {
+        std::string text = lua.substr(begin, end - begin);
+        uint64_t h = cache::hash(key, text);
+        part fresh;
+        part const *p = nullptr;
+        if (cached && cached->entries.count(h))
+            p = &cached->entries[h];
+        else
+        {
+            // A token that reaches the end of the part, such as a long
+            // string, goes on in the next one: lex them together
+            auto tokens = lex(text, 0);
+            if (end < lua.size() && tokens.size() && tokens.back().text.back() == '\n')
+                continue;
+            fresh = prepare(tokens, features);
+            p = &fresh;
+        }
+        if (cached)
+            cached->used[h] = *p;
+
+        size_t const offset = all.code.size();
+        for (auto t : p->code)
+            t.line += line, all.code.push_back(t);
+        for (auto note : p->notes)
+        {
+            note.first += offset;
+            note.second.line += line;
+            all.notes.push_back(note);
+        }
+        for (int n : p->compound)
+            all.compound.insert(n + line);
+
+        line += (int)std::count(text.begin(), text.end(), '\n');
+        begin = end;
+    }
+
+    // Fold constants and drop dead code
+    simplify(all.code, all.notes);
+
+    // Rename all variables according to our rules; with --search, names
+    // are chosen to make the P8Z compressed output as small as possible
+    auto score = [&](std::vector<token> const &c) -> size_t
+    {
+        auto str = join(c, all.compound);
+        return compress(std::vector<uint8_t>(str.begin(), str.end())).size();
+    };
+    rename(all.code, all.notes, search ? score : std::function<size_t(std::vector<token> const &)>());
+
+    return minified{ all.code, all.compound };
+}
+
+// PICO-8 token count of code[begin, end): every token counts as one,
+// except the free punctuation , . : ; ::, closing brackets, end, local,
+// and a unary minus or ~ right before a number
+inline int count_tokens(std::vector<token> const &code, size_t begin, size_t end)
+{
+    static std::set<std::string> const free = { ",", ".", ":", ";", "::", ")", "]", "}", "end", "local" };
+    int ret = 0;
+    for (size_t i = begin; i < end; ++i)
+    {
+        auto const &t = code[i];
+        if (t.kind != token::string && t.kind != token::number && free.count(t.text))
+            continue;
+        if ((is(code, i, "-") || is(code, i, "~")) && i + 1 < end
+             && code[i + 1].kind == token::number)
+        {
+            // Binary if it follows an operand
+            if (i == begin || !ends_operand(code, i - 1))
+                continue;
+        }
+        ++ret;
+    }
+    return ret;
+}
+
+// PICO-8 budget of the minified code as JSON: token count, character count
+// and P8Z compressed size, for the whole code then for each function. The
+// P8Z size is not the code compression limit that PICO-8 itself enforces,
+// hence the p8z_bytes key.
+inline std::string stats(minified const &m)
+{
+    auto budget = [&](size_t begin, size_t end)
+    {
+        std::vector<token> part(m.code.begin() + begin, m.code.begin() + end);
+        std::string str = join(part, m.compound);
+        return "\"tokens\": " + std::to_string(count_tokens(m.code, begin, end))
+             + ", \"chars\": " + std::to_string(str.size())
+             + ", \"p8z_bytes\": "
+             + std::to_string(compress(std::vector<uint8_t>(str.begin(), str.end())).size());
+    };
+
+    std::string ret = "{ " + budget(0, m.code.size()) + ", \"functions\": [";
+    char const *sep = "\n";
+    for (size_t i = 0; i < m.code.size(); ++i)
+    {
+        if (!is(m.code, i, "function"))
+            continue;
+
+        // "function a.b:c()", "local function f()", "f = function()"
+        std::string name;
+        for (size_t j = i + 1; j < m.code.size() && !is(m.code, j, "("); ++j)
+            name += m.code[j].text;
+        if (name.empty() && i >= 2 && is(m.code, i - 1, "=") && m.code[i - 2].kind == token::name)
+            name = m.code[i - 2].text;
+
+        ret += sep + std::string("  { \"name\": \"") + name + "\", \"line\": "
+             + std::to_string(m.code[i].line) + ", " + budget(i, skip_block(m.code, i)) + " }";
+        sep = ",\n";
+    }
+    return ret + "\n] }";
+}
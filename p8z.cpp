@@ -5,10 +5,132 @@
 #include <cstdint>
 #include <cstdlib>
 #include <regex>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <set>
+#include <algorithm>
 
-extern "C" {
-#include "zlib.h"
-extern z_const char * const z_errmsg[] = {};
+#include "p8z.h"
+#include "cart.h"
+#include "minify.h"
+
+extern "C" z_const char * const z_errmsg[] = {};
+
+// Reversible preprocessing filters applied to the data before deflate;
+// the matching inverse transforms are in p8uf() in p8u.p8.
+struct filter
+{
+    enum { none = 0, nibble = 1, delta = 2, transpose = 3 } type = none;
+    int stride = 0;
+
+    std::string name() const
+    {
+        static char const *names[] = { "none", "nibble", "delta", "transpose" };
+        return names[type] + (stride ? ':' + std::to_string(stride) : "");
+    }
+};
+
+// Candidates tried by --filter auto: nibble-packed graphics, 64-byte gfx rows,
+// 128-byte map rows, 68-byte sfx records, 4-byte music patterns, 16-bit fields.
+static std::vector<filter> const auto_filters =
+{
+    { filter::none, 0 },
+    { filter::nibble, 0 },
+    { filter::delta, 64 },
+    { filter::delta, 128 },
+    { filter::transpose, 128 },
+    { filter::transpose, 68 },
+    { filter::transpose, 4 },
+    { filter::transpose, 2 },
+};
+
+bool parse_filter(std::string const &s, filter &f)
+{
+    std::smatch m;
+    if (!std::regex_match(s, m, std::regex("(none|nibble|delta|transpose)(:([0-9]+))?")))
+        return false;
+    f.type = m[1] == "nibble" ? filter::nibble : m[1] == "delta" ? filter::delta
+           : m[1] == "transpose" ? filter::transpose : filter::none;
+    f.stride = m[3].matched ? atoi(m[3].str().c_str()) : 0;
+    // delta and transpose need a stride; the others do not accept one
+    return (f.type == filter::delta || f.type == filter::transpose) == (f.stride > 0);
+}
+
+std::vector<uint8_t> apply_filter(std::vector<uint8_t> v, filter const &f)
+{
+    if (f.type == filter::none)
+        return v;
+
+    // Pad to a multiple of 4 bytes so that the decoder, which only knows the
+    // size of its output in 32-bit words, sees the exact filtered length.
+    v.resize((v.size() + 3) & ~3);
+
+    std::vector<uint8_t> ret;
+    switch (f.type)
+    {
+    case filter::nibble:
+        // Store each 4-bit pixel in its own byte, low nibble first
+        for (uint8_t ch : v)
+        {
+            ret.push_back(ch & 0xf);
+            ret.push_back(ch >> 4);
+        }
+        break;
+    case filter::delta:
+        // Replace each byte with its difference to the byte one row above
+        ret = v;
+        for (size_t i = f.stride; i < v.size(); ++i)
+            ret[i] = v[i] - v[i - f.stride];
+        break;
+    case filter::transpose:
+    {
+        // Emit full rows of stride bytes column by column; the tail is kept as is
+        ret = v;
+        size_t rows = v.size() / f.stride;
+        for (size_t r = 0; r < rows; ++r)
+            for (size_t c = 0; c < (size_t)f.stride; ++c)
+                ret[c * rows + r] = v[r * f.stride + c];
+        break;
+    }
+    default:
+        break;
+    }
+    return ret;
+}
+
+// Inputs smaller than this are also compressed with every strategy when
+// not using --search; it is cheap, and short strings gain the most.
+static size_t const small_input = 4096;
+
+// The --search grid. memLevel also sets the block size, so it matters even
+// for strategies that ignore the level and the tuning values.
+std::vector<params> search_params()
+{
+    std::vector<params> ret;
+    for (int mem_level = 1; mem_level <= MAX_MEM_LEVEL; ++mem_level)
+    {
+        for (int strategy : { Z_HUFFMAN_ONLY, Z_RLE })
+            ret.push_back({ Z_BEST_COMPRESSION, strategy, mem_level });
+
+        // The optimal parse only uses the match finder settings
+        for (int chain : { 1024, 4096, 32768 })
+            ret.push_back({ Z_BEST_COMPRESSION, Z_OPTIMAL, mem_level, 32, 258, 258, chain });
+
+        for (int strategy : { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_FIXED })
+        {
+            for (int level = 1; level <= Z_BEST_COMPRESSION; ++level)
+                ret.push_back({ level, strategy, mem_level });
+            for (int lazy : { 16, 64, 258 })
+                for (int nice : { 64, 258 })
+                    for (int chain : { 1024, 4096, 32768 })
+                        ret.push_back({ Z_BEST_COMPRESSION, strategy, mem_level,
+                                        32, lazy, nice, chain });
+        }
+    }
+    return ret;
 }
 
 std::string encode59(std::vector<uint8_t> const &v)
@@ -43,49 +165,485 @@ std::string encode59(std::vector<uint8_t> const &v)
     return '"' + ret + '"';
 }
 
-int main(int argc, char *argv[])
+// Minimal P8Z decoder following p8u(), used to inspect compressed streams
+class reader
 {
-    std::vector<uint8_t> input;
-    for (uint8_t ch : std::vector<char>{ std::istreambuf_iterator<char>(std::cin),
-                                         std::istreambuf_iterator<char>() })
-        input.push_back(ch);
-
-    // Prepare a vector twice as big... we don't really care.
-    std::vector<uint8_t> output(input.size() * 2 + 10);
-
-    z_stream zs = {};
-    zs.zalloc = [](void *, unsigned int n, unsigned int m) -> void * { return new char[n * m]; };
-    zs.zfree = [](void *, void *p) -> void { delete[] (char *)p; };
-    zs.next_in = input.data();
-    zs.next_out = output.data();
-    zs.avail_in = (uInt)input.size();
-    zs.avail_out = (uInt)output.size();
-    
-    deflateInit(&zs, Z_BEST_COMPRESSION);
-    deflate(&zs, Z_FINISH);
-    // Strip first 2 bytes (deflate header) and last 4 bytes (checksum)
-    output = std::vector<uint8_t>(output.begin() + 2, output.begin() + zs.total_out - 4);
-    deflateEnd(&zs);
-
-    if (argc == 3 && argv[1] == std::string("--count"))
-    {
-        size_t count = atoi(argv[2]);
-        fwrite(output.data(), 1, std::min(count, output.size()), stdout);
-        return EXIT_SUCCESS;
+public:
+    reader(std::vector<uint8_t> const &data) : m_data(data) {}
+
+    // Decode the whole stream; if bit_pos is given, it receives the number
+    // of input bits consumed when each output byte was written.
+    std::vector<uint8_t> decode(std::vector<size_t> *bit_pos = nullptr)
+    {
+        std::vector<uint8_t> ret;
+        auto write_byte = [&](uint8_t ch)
+        {
+            ret.push_back(ch);
+            if (bit_pos)
+                bit_pos->push_back(m_pos);
+        };
+
+        m_blocks = m_stored = m_static = 0;
+        for (; m_pos < m_data.size() * 8; ++m_blocks)
+        {
+            if (!read_bits(1))
+            {
+                if (!read_bits(1))
+                    break; // end of stream
+                ++m_stored;
+                for (int n = read_bits(16); n--; )
+                    write_byte(read_bits(8));
+                continue;
+            }
+
+            std::vector<int> lit(288), dist(32);
+            if (!read_bits(1))
+            {
+                ++m_static;
+                for (int i = 0; i < 288; ++i)
+                    lit[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+                std::fill(dist.begin(), dist.end(), 5);
+            }
+            else
+            {
+                lit.resize(257 + read_bits(5));
+                dist.resize(1 + read_bits(5));
+                std::vector<int> bl(19);
+                for (int i = 0, n = 4 + read_bits(4); i < n; ++i)
+                    bl[i < 3 ? 16 + i : i - 3] = read_bits(3);
+                huffman bl_tree(bl);
+                for (auto *desc : { &lit, &dist })
+                {
+                    // Runs do not cross from one tree to the other
+                    for (size_t i = 0; i < desc->size(); )
+                    {
+                        int sym = read_symbol(bl_tree);
+                        int n = sym == 16 ? 3 + read_bits(2) : sym == 17 ? 3 + read_bits(3)
+                              : sym == 18 ? 11 + read_bits(7) : 1;
+                        int len = sym == 16 ? (*desc)[i ? i - 1 : 0] : sym > 16 ? 0 : sym;
+                        for (; n-- && i < desc->size(); ++i)
+                            (*desc)[i] = len;
+                    }
+                }
+            }
+
+            huffman lit_tree(lit), dist_tree(dist);
+            for (int sym = read_symbol(lit_tree); sym != 256; sym = read_symbol(lit_tree))
+            {
+                if (sym < 0 || m_pos > m_data.size() * 8)
+                    return ret; // invalid stream
+                if (sym < 256)
+                {
+                    write_byte(sym);
+                    continue;
+                }
+                int len = 3 + (sym < 285 ? read_varint(sym - 257, 4) : 255);
+                size_t distance = 1 + read_varint(read_symbol(dist_tree), 2);
+                if (distance > ret.size())
+                    return ret;
+                while (len--)
+                    write_byte(ret[ret.size() - distance]);
+            }
+        }
+        return ret;
     }
 
-    if (argc == 3 && argv[1] == std::string("--skip"))
+    // Number of blocks found by decode(), and how many were stored or static
+    size_t blocks() const { return m_blocks; }
+    size_t stored_blocks() const { return m_stored; }
+    size_t static_blocks() const { return m_static; }
+
+private:
+    // Canonical Huffman code, decoded one bit at a time like in puff.c
+    struct huffman
     {
-        size_t skip = atoi(argv[2]);
-        output.erase(output.begin(), output.begin() + std::min(skip, output.size()));
+        huffman(std::vector<int> const &lengths)
+        {
+            for (int len : lengths)
+                ++count[len];
+            count[0] = 0;
+            for (int len = 1; len < 16; ++len)
+                for (size_t i = 0; i < lengths.size(); ++i)
+                    if (lengths[i] == len)
+                        symbols.push_back((int)i);
+        }
+
+        int count[16] = {};
+        std::vector<int> symbols;
+    };
+
+    int read_bits(int n)
+    {
+        int ret = 0;
+        for (int i = 0; i < n; ++i, ++m_pos)
+            if (m_pos < m_data.size() * 8)
+                ret |= (m_data[m_pos / 8] >> (m_pos % 8) & 1) << i;
+        return ret;
+    }
+
+    int read_symbol(huffman const &h)
+    {
+        for (int len = 1, code = 0, first = 0, index = 0; len < 16; ++len)
+        {
+            code |= read_bits(1);
+            if (code - h.count[len] < first)
+                return h.symbols[index + (code - first)];
+            index += h.count[len];
+            first = (first + h.count[len]) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+    int read_varint(int sym, int j)
+    {
+        if (sym <= j)
+            return sym;
+        int k = sym / j - 1;
+        return ((sym % j + j) << k) + read_bits(k);
+    }
+
+    std::vector<uint8_t> const &m_data;
+    size_t m_pos = 0, m_blocks = 0, m_stored = 0, m_static = 0;
+};
+
+// Compress input with every (filter, params) job on a pool of threads and
+// return the smallest output; ties go to the earliest job so that the
+// result is deterministic.
+std::vector<uint8_t> run_jobs(std::vector<uint8_t> const &input,
+                              std::vector<std::tuple<filter, params>> const &jobs,
+                              size_t &best)
+{
+    std::vector<uint8_t> ret;
+    std::tuple<size_t, size_t, size_t> best_cost;
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+
+    best = jobs.size();
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < jobs.size(); i = next++)
+        {
+            auto output = compress(apply_filter(input, std::get<0>(jobs[i])), std::get<1>(jobs[i]));
+            auto cost = std::make_tuple(encode59(output).size(), output.size(), i);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (best == jobs.size() || cost < best_cost)
+                ret = std::move(output), best_cost = cost, best = i;
+        }
+    };
+
+    std::vector<std::thread> threads(std::max(1u, std::thread::hardware_concurrency()));
+    for (auto &t : threads)
+        t = std::thread(worker);
+    for (auto &t : threads)
+        t.join();
+
+    return ret;
+}
+
+// Check that the output of the poke variant of p8u() fits in memory and tell
+// where the RAM part of the data may be stored for in-place decoding, i.e.
+// when the decoder output overwrites compressed data it has already read.
+bool report_poke(std::vector<uint8_t> const &input, std::vector<uint8_t> const &output,
+                 size_t address, size_t ram_size)
+{
+    if (address + input.size() > 0x10000)
+    {
+        std::cerr << "p8z: output does not fit in memory at this address\n";
+        return false;
     }
-    else if (argc != 1)
+
+    std::vector<size_t> bit_pos;
+    if (reader(output).decode(&bit_pos) != input)
+    {
+        std::cerr << "p8z: internal error, stream does not decode\n";
+        return false;
+    }
+
+    // Output byte i is written at address + i once (bit_pos[i] + 7) / 8 bytes
+    // of the RAM data were read; the next RAM byte must not be below that.
+    ptrdiff_t margin = 0;
+    for (size_t i = 0; i < bit_pos.size(); ++i)
+        if ((bit_pos[i] + 7) / 8 < ram_size)
+            margin = std::max(margin, (ptrdiff_t)(i + 1) - (ptrdiff_t)((bit_pos[i] + 7) / 8));
+
+    char buf[160];
+    snprintf(buf, sizeof(buf), "p8z: poke mode, decode with p8u(c, addr, %zu, 0x%04zx), writes %zu bytes\n",
+             ram_size, address, input.size());
+    std::cerr << buf;
+    if (ram_size)
+    {
+        snprintf(buf, sizeof(buf), "p8z: for in-place decoding, addr must be at least 0x%04zx\n",
+                 (size_t)std::max((ptrdiff_t)0, (ptrdiff_t)address + margin));
+        std::cerr << buf;
+    }
+    return true;
+}
+
+std::vector<uint8_t> read_file(std::istream &stream)
+{
+    std::vector<uint8_t> ret;
+    for (uint8_t ch : std::vector<char>{ std::istreambuf_iterator<char>(stream),
+                                         std::istreambuf_iterator<char>() })
+        ret.push_back(ch);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::vector<uint8_t>> chunks;
+    bool has_count = false, has_skip = false, auto_filter = false, search = false;
+    bool has_poke = false, print_features = false, has_cart = false, do_minify = false;
+    params defaults;
+    size_t count = 0, skip = 0, poke = 0;
+    unsigned block_size = 0;
+    filter f;
+    cart c;
+    std::vector<cart::layout const *> sections;
+    std::set<std::string> minify_features;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--count" && i + 1 < argc)
+            has_count = true, count = atoi(argv[++i]);
+        else if (arg == "--skip" && i + 1 < argc)
+            has_skip = true, skip = atoi(argv[++i]);
+        else if (arg == "--search")
+            search = true;
+        else if (arg == "--poke" && i + 1 < argc)
+            has_poke = true, poke = strtoul(argv[++i], nullptr, 0);
+        else if (arg == "--block-size" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            block_size = atoi(argv[++i]);
+        else if (arg == "--chunk" && i + 1 < argc)
+        {
+            std::ifstream file(argv[++i], std::ios::binary);
+            if (!file)
+            {
+                std::cerr << "p8z: cannot open " << argv[i] << "\n";
+                return EXIT_FAILURE;
+            }
+            chunks.push_back(read_file(file));
+        }
+        else if (arg == "--cart" && i + 1 < argc)
+        {
+            std::ifstream file(argv[++i], std::ios::binary);
+            auto data = file ? read_file(file) : std::vector<uint8_t>();
+            if (!file || !c.parse(std::string(data.begin(), data.end())))
+            {
+                std::cerr << "p8z: cannot read cart " << argv[i] << "\n";
+                return EXIT_FAILURE;
+            }
+            has_cart = true;
+        }
+        else if (arg == "--section" && i + 1 < argc && cart::find_layout(argv[i + 1]))
+            sections.push_back(cart::find_layout(argv[++i]));
+        else if (arg == "--minify")
+            do_minify = true;
+        else if (arg == "--feature" && i + 1 < argc)
+            minify_features.insert(argv[++i]);
+        else if (arg == "--features")
+            print_features = true;
+        else if (arg == "--optimal")
+            defaults.strategy = Z_OPTIMAL;
+        else if (arg == "--filter" && i + 1 < argc && argv[i + 1] == std::string("auto"))
+            auto_filter = true, ++i;
+        else if (arg == "--filter" && i + 1 < argc && parse_filter(argv[i + 1], f))
+            ++i;
+        else
+        {
+            std::cerr << "Invalid arguments\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The poke variant of p8u writes to memory, where p8uf() cannot be used;
+    // it is not supported for chunks either
+    // --section, --minify and --feature only make sense when writing a cart
+    if ((has_count && has_skip)
+         || (has_poke && (auto_filter || f.type != filter::none || chunks.size()))
+         || (!has_cart && (sections.size() || do_minify || minify_features.size()))
+         || (sections.size() && chunks.size()))
     {
         std::cerr << "Invalid arguments\n";
         return EXIT_FAILURE;
     }
 
+    // With --section, the data comes from the cart ROM, and without
+    // --chunk, from stdin
+    std::vector<uint8_t> rom = c.rom();
+    bool const has_chunks = chunks.size() > 0;
+    if (sections.size())
+    {
+        chunks.resize(1);
+        for (auto const *l : sections)
+            chunks[0].insert(chunks[0].end(), rom.begin() + l->addr, rom.begin() + l->addr + l->size);
+    }
+    else if (!has_chunks)
+        chunks.push_back(read_file(std::cin));
+    size_t const ram_size = has_count ? count : skip;
+
+    if (has_cart && ram_size > rom.size())
+    {
+        std::cerr << "p8z: cart RAM part is larger than the cart ROM\n";
+        return EXIT_FAILURE;
+    }
+
+    // Compress each chunk as an independent stream. Chunks start on a byte
+    // boundary in cart RAM and on a 7-byte boundary (10 characters) in the
+    // string, so that p8uc() can find them from the table printed below.
+    std::vector<uint8_t> output;
+    std::vector<size_t> index;
+    size_t stored_blocks = 0, static_blocks = 0, dynamic_blocks = 0;
+    bool uses_filter = false;
+    for (auto const &input : chunks)
+    {
+        if (output.size() > ram_size)
+            output.resize(ram_size + (output.size() - ram_size + 6) / 7 * 7);
+        index.push_back(output.size());
+
+        // Build the list of (filter, params) combinations to try
+        std::vector<params> variants = { defaults };
+        if (search)
+            variants = search_params();
+        else if (input.size() < small_input)
+            for (int strategy : { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_OPTIMAL })
+                if (strategy != defaults.strategy)
+                    variants.push_back({ defaults.level, strategy, defaults.mem_level });
+
+        std::vector<std::tuple<filter, params>> jobs;
+        for (auto const &candidate : auto_filter ? auto_filters : std::vector<filter>{ f })
+            for (auto p : variants)
+            {
+                p.block_size = block_size;
+                jobs.push_back(std::make_tuple(candidate, p));
+            }
+
+        size_t best;
+        std::vector<uint8_t> chunk_output = run_jobs(input, jobs, best);
+        filter chunk_filter = std::get<0>(jobs[best]);
+        std::string prefix = has_chunks ? "p8z: chunk " + std::to_string(index.size()) + ": " : "p8z: ";
+
+        if (search)
+            std::cerr << prefix << std::get<1>(jobs[best]).name() << "\n";
+
+        // The cart needs to know which inverse filter to apply
+        if (chunk_filter.type != filter::none)
+            std::cerr << prefix << "filter " << chunk_filter.name() << ", decode with p8uf(t, "
+                      << (int)chunk_filter.type << ", " << chunk_filter.stride << ")\n";
+        else if (auto_filter)
+            std::cerr << prefix << "filter none\n";
+
+        reader r(chunk_output);
+        r.decode();
+        std::cerr << prefix << r.blocks() << (r.blocks() == 1 ? " block: " : " blocks: ") << r.stored_blocks() << " stored, "
+                  << r.static_blocks() << " static, "
+                  << r.blocks() - r.stored_blocks() - r.static_blocks() << " dynamic\n";
+        stored_blocks += r.stored_blocks();
+        static_blocks += r.static_blocks();
+        dynamic_blocks += r.blocks() - r.stored_blocks() - r.static_blocks();
+        uses_filter |= chunk_filter.type != filter::none;
+
+        // Only the yield variant of p8u can decode more than 287 blocks
+        if (r.blocks() > 287)
+            std::cerr << prefix << "warning: " << r.blocks() << " blocks, decode with the yield variant of p8u\n";
+
+        if (has_poke && !report_poke(input, chunk_output, poke, ram_size))
+            return EXIT_FAILURE;
+
+        output.insert(output.end(), chunk_output.begin(), chunk_output.end());
+    }
+
+    if (has_chunks)
+    {
+        std::string list;
+        for (size_t offset : index)
+            list += (list.empty() ? "" : ",") + std::to_string(offset);
+        std::cerr << "p8z: chunk index {" << list << "}, decode chunk k with p8uc(c, addr, "
+                  << ram_size << ", index, k)\n";
+    }
+
+    // The minify features for a decoder with only the code this data needs
+    std::string features;
+    for (auto const &feature : std::vector<std::tuple<bool, char const *>>
+         {
+             { !stored_blocks, "no_stored" },
+             { !static_blocks, "no_static" },
+             { !dynamic_blocks, "no_dynamic" },
+             { uses_filter, "filter" },
+             { ram_size > 0 && output.size() <= ram_size, "ram_only" },
+             { ram_size == 0, "string_only" },
+             { has_poke, "poke" },
+             { has_chunks, "chunk" },
+         })
+        if (std::get<0>(feature))
+            features += (features.empty() ? "" : " ") + std::string(std::get<1>(feature));
+    std::cerr << "p8z: decoder features: " << features << "\n";
+
+    if (print_features)
+    {
+        std::cout << features << '\n';
+        return EXIT_SUCCESS;
+    }
+
+    // With --cart, write the cart with the compressed sections cleared, the
+    // cart RAM part of the data at address 0, and the rest of the data in
+    // the global c at the top of the code, e.g. for p8u(c, 0, ram_size)
+    if (has_cart)
+    {
+        size_t const ram_part = std::min(ram_size, output.size());
+
+        // Refuse to overwrite data that the cart may still use: only the
+        // sections given with --section are known to be free
+        for (auto const &l : cart::layouts())
+        {
+            size_t const end = std::min(ram_part, l.addr + l.size);
+            if (l.addr >= end || std::find(sections.begin(), sections.end(), &l) != sections.end())
+                continue;
+            if (std::any_of(rom.begin() + l.addr, rom.begin() + end, [](uint8_t x) { return x != 0; }))
+            {
+                std::cerr << "p8z: cart RAM part overwrites the " << l.name << " section; "
+                          << "compress it with --section " << l.name << " or lower --count\n";
+                return EXIT_FAILURE;
+            }
+        }
+
+        for (auto const *l : sections)
+        {
+            std::fill(rom.begin() + l->addr, rom.begin() + l->addr + l->size, 0);
+            c.set_rom(rom, l->addr, l->addr + l->size);
+        }
+        std::copy(output.begin(), output.begin() + ram_part, rom.begin());
+        c.set_rom(rom, 0, ram_part);
+
+        cart::section *lua = c.find("lua");
+        if (!lua)
+            lua = &c.add("lua");
+        if (do_minify)
+        {
+            for (size_t i = 0, j = 0; i < features.size(); i = j + 1)
+            {
+                j = std::min(features.find(' ', i), features.size());
+                minify_features.insert(features.substr(i, j - i));
+            }
+            lua->text = minify(lua->text, lua->line, minify_features, false).str() + "\n";
+        }
+        output.erase(output.begin(), output.begin() + ram_part);
+        lua->text = "c=" + encode59(output) + "\n" + lua->text;
+        std::cout << c.str();
+        return EXIT_SUCCESS;
+    }
+
+    if (has_count)
+    {
+        fwrite(output.data(), 1, std::min(count, output.size()), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    if (has_skip)
+        output.erase(output.begin(), output.begin() + std::min(skip, output.size()));
+
     std::cout << encode59(output) << '\n';
     return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,79 @@
+//
+// P8Z compression, shared by p8z and minify
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include "zlib.h"
+}
+
+// Parameters for one deflate run; --search tries many of them
+struct params
+{
+    int level = Z_BEST_COMPRESSION;
+    int strategy = Z_DEFAULT_STRATEGY;
+    int mem_level = 8;
+    // deflateTune() values, or 0 to keep the ones from the level
+    int good = 0, lazy = 0, nice = 0, chain = 0;
+    // deflateBlockSize() value, or 0 for no limit other than mem_level
+    unsigned block_size = 0;
+
+    std::string name() const
+    {
+        std::string ret = "level " + std::to_string(level)
+                        + ", strategy " + std::to_string(strategy)
+                        + ", mem_level " + std::to_string(mem_level);
+        if (good)
+            ret += ", tune " + std::to_string(good) + " " + std::to_string(lazy)
+                 + " " + std::to_string(nice) + " " + std::to_string(chain);
+        return ret;
+    }
+};
+
+// Compress input to a raw P8Z stream, without the zlib header and checksum
+inline std::vector<uint8_t> compress(std::vector<uint8_t> const &input, params const &p = params())
+{
+    z_stream zs = {};
+    zs.zalloc = [](void *, unsigned int n, unsigned int m) -> void * { return new char[n * m]; };
+    zs.zfree = [](void *, void *p) -> void { delete[] (char *)p; };
+    zs.next_in = (Bytef *)input.data();
+    zs.avail_in = (uInt)input.size();
+
+    deflateInit2(&zs, p.level, Z_DEFLATED, MAX_WBITS, p.mem_level, p.strategy);
+    if (p.good)
+        deflateTune(&zs, p.good, p.lazy, p.nice, p.chain);
+    if (p.block_size)
+        deflateBlockSize(&zs, p.block_size);
+
+    // deflateBound() does not know about small blocks, whose headers can
+    // make the output much larger than the input, so grow the buffer until
+    // deflate() is done
+    std::vector<uint8_t> output(deflateBound(&zs, (uLong)input.size()));
+    for (;;)
+    {
+        zs.next_out = output.data() + zs.total_out;
+        zs.avail_out = (uInt)(output.size() - zs.total_out);
+        int ret = deflate(&zs, Z_FINISH);
+        if (ret == Z_STREAM_END)
+            break;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            fprintf(stderr, "p8z: deflate failed with error %d\n", ret);
+            exit(EXIT_FAILURE);
+        }
+        output.resize(output.size() * 2);
+    }
+
+    // Strip first 2 bytes (deflate header) and last 4 bytes (checksum)
+    output = std::vector<uint8_t>(output.begin() + 2, output.begin() + zs.total_out - 4);
+    deflateEnd(&zs);
+
+    return output;
+}
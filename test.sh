@@ -22,9 +22,8 @@ while [ -n "$1" ]; do
 done
 
 minify() {
-  head -n 3 "$1"
-  if [ -n "$NO_MINIFY" ]; then cat "$1" | tail -n +4; return; fi
-  ./minify < "$1"
+  if [ -n "$NO_MINIFY" ]; then cat "$1"; return; fi
+  ./minify --cart $MINIFY_FLAGS < "$1"
 }
 
 # Inspect p8u.p8 for stats
@@ -38,12 +37,11 @@ echo ""
 # Check that the code works
 test_common() {
   minify p8u.p8 > "$TMPFILE.tmp.p8"
-  printf 'c=' >> "$TMPFILE.tmp.p8"
-  cat $* | ./p8z --count $EXTRA > "$TMPFILE.data"
-  cat $* | ./p8z --skip $EXTRA >> "$TMPFILE.tmp.p8"
-  echo "t=p8u(c,0,$EXTRA) x=0 for i=1,#t do x+=t[i] end printh('Uncompressed '..(4*#t)..' Checksum '..tostr(x, true)) if puts and #t < 128 then puts(t) end" >> "$TMPFILE.tmp.p8"
-  z8tool convert --data "$TMPFILE.data" "$TMPFILE.tmp.p8" "$TMPFILE"
-  rm -f "$TMPFILE.tmp.p8" "$TMPFILE.data"
+  # When CHECK has the hex dump of the input, compare it with the output
+  echo "${DECODE:-t=p8u(c,0,$EXTRA)} $UNFILTER e='' h='$CHECK' for i=0,#h/2-1 do if t[flr(i/4)+1]>><i%4*8-16&255~=tonum('0x'..sub(h,i*2+1,i*2+2)) then e='Mismatch at '..i..' ' break end end x=0 for i=1,#t do x+=t[i] end printh(e..'Uncompressed '..(4*#t)..' Checksum '..tostr(x, true)) if puts and #t < 128 then puts(t) end" >> "$TMPFILE.tmp.p8"
+  cat $* | ./p8z --cart "$TMPFILE.tmp.p8" --count $EXTRA $P8Z_FLAGS > "$TMPFILE.out.p8"
+  mv "$TMPFILE.out.p8" "$TMPFILE"
+  rm -f "$TMPFILE.tmp.p8"
   out="$($TOOL "$TMPFILE")"
   case "$out" in Uncompressed*) echo "$out" ;; *) echo "ERROR! $out" ;; esac
 }
@@ -60,6 +58,85 @@ test_file() {
   test_common "$@"
 }
 
+test_filter() {
+  STR="$4"
+  echo "# Compressing string with filter $1: '$STR'"
+  printf '%s' "$STR" >| "$TMPFILE"
+  P8Z_FLAGS="--filter $1"
+  MINIFY_FLAGS="filter"
+  UNFILTER="t=p8uf(t,$2,$3)"
+  test_common "$TMPFILE"
+  P8Z_FLAGS=""
+  MINIFY_FLAGS=""
+  UNFILTER=""
+}
+
+test_poke() {
+  STR="$1"
+  echo "# Compressing string in poke mode: '$STR'"
+  printf '%s' "$STR" >| "$TMPFILE"
+  P8Z_FLAGS="--poke 0x8000"
+  MINIFY_FLAGS="poke"
+  DECODE="a=p8u(c,0,$EXTRA,0x8000) t={} for i=0x8000,a-1,4 do add(t,peek4(i)) end"
+  test_common "$TMPFILE"
+  P8Z_FLAGS=""
+  MINIFY_FLAGS=""
+  DECODE=""
+}
+
+# Compress a file, decode it with a decoder built with the given features,
+# and compare the output with the file
+test_variant() {
+  echo "# Compressing file with features $1: $2"
+  MINIFY_FLAGS="$1"
+  CHECK="$(od -An -v -tx1 "$2" | tr -d ' \n')"
+  test_common "$2"
+  MINIFY_FLAGS=""
+  CHECK=""
+}
+
+test_yield() {
+  echo "# Compressing file with --block-size $1: $2"
+  P8Z_FLAGS="--block-size $1"
+  MINIFY_FLAGS="yield"
+  DECODE="co=cocreate(function() t=p8u(c,0,$EXTRA) end) while costatus(co)!='dead' do coresume(co) end"
+  CHECK="$(od -An -v -tx1 "$2" | tr -d ' \n')"
+  test_common "$2"
+  P8Z_FLAGS=""
+  MINIFY_FLAGS=""
+  DECODE=""
+  CHECK=""
+}
+
+# Compress files as chunks, then decode each chunk on its own; the index
+# comes from a first run of p8z, which gives the same output
+test_chunk() {
+  P8Z_FLAGS=""
+  for i in "$@"; do P8Z_FLAGS="$P8Z_FLAGS --chunk $i"; done
+  index="$(./p8z --count $EXTRA $P8Z_FLAGS 2>&1 >/dev/null | sed -n 's/.*chunk index \({[0-9,]*}\).*/\1/p')"
+  MINIFY_FLAGS="chunk"
+  k=0
+  for i in "$@"; do
+    k=$((k + 1))
+    echo "# Decoding chunk $k of $#: $i"
+    DECODE="t=p8uc(c,0,$EXTRA,$index,$k)"
+    CHECK="$(od -An -v -tx1 "$i" | tr -d ' \n')"
+    test_common /dev/null
+  done
+  P8Z_FLAGS=""
+  MINIFY_FLAGS=""
+  DECODE=""
+  CHECK=""
+}
+
+# Check that minify gives the expected code; \n in either string is a
+# line break
+test_minify() {
+  echo "# Minifying: '$1'"
+  out="$(printf '%b\n' "$1" | ./minify $MINIFY_FLAGS)"
+  if [ "$out" = "$(printf '%b' "$2")" ]; then echo "$out"; else echo "ERROR! got '$out'"; fi
+}
+
 test_string ""
 test_string "ABCD"
 test_string "abc123def456"
@@ -68,6 +145,71 @@ test_string "2111222233334444555521112222333344445555211122223333444455551111222
 test_string "to be or not to be or to be or maybe not to be or maybe finally to be..."
 test_string "98398743287509834098332165732043059430973981643159327439827439217594327643982715432543"
 
+test_filter nibble 1 0 "11112222333344445555"
+test_filter delta:4 2 4 "21112222333344445555211122223333444455552111222233334444555511112222333344445555"
+test_filter transpose:3 3 3 "abc123def456"
+
+test_poke "ABCD"
+test_poke "to be or not to be or to be or maybe not to be or maybe finally to be..."
+
+# Payloads for test_variant: stored, static and dynamic blocks, runs of
+# bytes and of words, and random data larger than the cart RAM part
+PAYLOADS=".p8z-stored.bin .p8z-static.bin .p8z-dynamic.bin .p8z-runs.bin .p8z-random.bin"
+head -c 300 /dev/urandom > .p8z-stored.bin
+printf 'to be or not to be or to be or maybe not to be' > .p8z-static.bin
+head -c 3000 p8u.p8 > .p8z-dynamic.bin
+{ head -c 400 /dev/zero | tr '\0' a; yes abcd | head -c 500 | tr -d '\n'; yes xyz | head -c 300 | tr -d '\n'; } > .p8z-runs.bin
+head -c 3000 /dev/urandom > .p8z-random.bin
+
+for features in fast_ram fast_copy fast_tree fast_static "fast_ram fast_copy fast_tree fast_static"; do
+  for i in $PAYLOADS; do test_variant "$features" $i; done
+done
+
+# The ram_only and string_only profiles, with all the data in cart RAM
+# and in the string respectively
+EXTRA=17152
+for i in $PAYLOADS; do test_variant ram_only $i; done
+EXTRA=0
+for i in $PAYLOADS; do test_variant string_only $i; done
+EXTRA=2048
+
+# More than the 287 blocks that the other variants can decode
+test_yield 1 .p8z-stored.bin
+test_yield 16 .p8z-runs.bin
+test_yield 64 .p8z-dynamic.bin
+test_yield 64 .p8z-random.bin
+
+# Chunks in cart RAM, across the end of cart RAM, and in the string
+test_chunk .p8z-dynamic.bin .p8z-static.bin .p8z-random.bin .p8z-runs.bin .p8z-stored.bin
+
+test_minify 'print(1 .. "x", 1 .. 2, 0x1f .. a, 1.5 .. a, a .. 1)' 'print(1 .."x",1 ..2,0x1f ..a,1.5 ..a,a..1)'
+test_minify 'local abc=1\nif (abc) print(1)\nprint(2)\nwhile (abc<3) abc+=1\nprint(abc)' 'local a=1if(a)print(1)\nprint(2)while(a<3)a+=1\nprint(a)'
+
+# Renaming: shadowed locals, closures, loop variables and parameters
+test_minify 'local function foo(alpha, beta)\n  local gamma = alpha + beta\n  do\n    local gamma = gamma * 2\n    print(gamma)\n  end\n  return gamma\nend\nprint(foo(1, 2))' 'local function a(a,b)local a=a+b do local a=a*2print(a)end return a end print(a(1,2))'
+test_minify 'function make(count)\n  local total = 0\n  return function(step)\n    total += step * count\n    return total\n  end\nend' 'function make(b)local a=0return function(c)a+=c*b return a end end'
+test_minify 'function f()\n  local first = 1\n  local getter = function() return first end\n  local second = 2\n  return getter() + second\nend' 'function f()local f=1local f=function()return f end local a=2return f()+a end'
+test_minify 'function f(n)\n  for index = 1, n do\n    local value = index * 2\n    print(value)\n  end\nend' 'function f(n)for n=1,n do local n=n*2print(n)end end'
+
+# Simplification: folded expressions, literal conditions, unused functions
+test_minify 'total = 1 + 2 * 3\nlocal width = 2 * 8\nprint(width, 3 - -1)' 'total=7local a=16print(a,4)'
+test_minify 'local debug = false\nif debug then print("x") end\nlocal function unused() return 1 end\nif true then print(1) else print(2) end\nwhile false do print(3) end' 'print(1)'
+
+# Feature tags
+MINIFY_FLAGS="fast"
+test_minify 'local a = 1 -- +fast\nlocal a = 2 -- -fast\nprint(a)' 'local a=1print(a)'
+MINIFY_FLAGS=""
+test_minify 'local a = 1 -- +fast\nlocal a = 2 -- -fast\nprint(a)' 'local a=2print(a)'
+
+# --stats, and --cache, which must give the same code on a second run
+MINIFY_FLAGS="--stats"
+test_minify 'print("hello")' '{ "tokens": 3, "chars": 14, "p8z_bytes": 16, "functions": [\n] }'
+MINIFY_FLAGS="--cache .p8z-cache"
+test_minify 'function f()\n  local first = 1\n  return first\nend\nfunction g() return 2 end' 'function f()local f=1return f end function g()return 2 end'
+test_minify 'function f()\n  local first = 1\n  return first\nend\nfunction g() return 2 end' 'function f()local f=1return f end function g()return 2 end'
+MINIFY_FLAGS=""
+rm -f .p8z-cache
+
 find ../payloads -type f | tail -n +1 | while read i; do test_file $i; done
 
 #printf %s $STR | od -v -An -t x1 -w1000
@@ -76,5 +218,5 @@ find ../payloads -type f | tail -n +1 | while read i; do test_file $i; done
 #          | xargs -n2 | awk '{ print "0x"$$2"."$$1"," }' | sed 's/0*,/,/ ; s/0x00*/0x/g' \
 #          | xargs -n 6 | tr -d ' ' >> $(TMPCART2)
 
-rm -f "$TMPFILE"
+rm -f "$TMPFILE" $PAYLOADS
 
@@ -83,6 +83,9 @@ local block_state deflate_slow   OF((deflate_state *s, int flush));
 #endif
 local block_state deflate_rle    OF((deflate_state *s, int flush));
 local block_state deflate_huff   OF((deflate_state *s, int flush));
+#ifdef P8Z
+local block_state deflate_optimal OF((deflate_state *s, int flush));
+#endif
 local void lm_init        OF((deflate_state *s));
 local void putShortMSB    OF((deflate_state *s, uInt b));
 local void flush_pending  OF((z_streamp strm));
@@ -107,6 +110,16 @@ local  void check_match OF((deflate_state *s, IPos start, IPos match,
 #define NIL 0
 /* Tail of hash chains */
 
+#ifdef P8Z
+#  define MAX_STRATEGY Z_OPTIMAL
+#else
+#  define MAX_STRATEGY Z_FIXED
+#endif
+/* Highest valid strategy value */
+
+#define MAX_PASSES 15
+/* Maximum number of parse passes per block for Z_OPTIMAL */
+
 #ifndef TOO_FAR
 #  define TOO_FAR 4096
 #endif
@@ -297,7 +310,7 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
 #endif
     if (memLevel < 1 || memLevel > MAX_MEM_LEVEL || method != Z_DEFLATED ||
         windowBits < 8 || windowBits > 15 || level < 0 || level > 9 ||
-        strategy < 0 || strategy > Z_FIXED || (windowBits == 8 && wrap != 1)) {
+        strategy < 0 || strategy > MAX_STRATEGY || (windowBits == 8 && wrap != 1)) {
         return Z_STREAM_ERROR;
     }
     if (windowBits == 8) windowBits = 9;  /* until 256-byte window bug fixed */
@@ -325,6 +338,7 @@ int ZEXPORT deflateInit2_(strm, level, method, windowBits, memLevel, strategy,
     s->high_water = 0;      /* nothing written to s->window yet */
 
     s->lit_bufsize = 1 << (memLevel + 6); /* 16K elements by default */
+    s->lit_end = s->lit_bufsize - 1;
 
     overlay = (ushf *) ZALLOC(strm, s->lit_bufsize, sizeof(ush)+2);
     s->pending_buf = (uchf *) overlay;
@@ -581,7 +595,7 @@ int ZEXPORT deflateParams(strm, level, strategy)
 #else
     if (level == Z_DEFAULT_COMPRESSION) level = 6;
 #endif
-    if (level < 0 || level > 9 || strategy < 0 || strategy > Z_FIXED) {
+    if (level < 0 || level > 9 || strategy < 0 || strategy > MAX_STRATEGY) {
         return Z_STREAM_ERROR;
     }
     func = configuration_table[s->level].func;
@@ -632,6 +646,25 @@ int ZEXPORT deflateTune(strm, good_length, max_lazy, nice_length, max_chain)
     return Z_OK;
 }
 
+#ifdef P8Z
+/* ========================================================================= */
+int ZEXPORT deflateBlockSize(strm, max_symbols)
+    z_streamp strm;
+    unsigned max_symbols;
+{
+    deflate_state *s;
+
+    if (deflateStateCheck(strm) || max_symbols == 0) return Z_STREAM_ERROR;
+    s = strm->state;
+    /* Blocks are flushed when last_lit reaches lit_end; the buffers keep
+     * their size, only the flush point moves.
+     */
+    if (max_symbols < s->lit_bufsize - 1)
+        s->lit_end = max_symbols;
+    return Z_OK;
+}
+#endif
+
 /* =========================================================================
  * For the default windowBits of 15 and memLevel of 8, this function returns
  * a close to exact, as well as small, upper bound on the compressed size.
@@ -1000,6 +1033,9 @@ int ZEXPORT deflate (strm, flush)
         bstate = s->level == 0 ? deflate_stored(s, flush) :
                  s->strategy == Z_HUFFMAN_ONLY ? deflate_huff(s, flush) :
                  s->strategy == Z_RLE ? deflate_rle(s, flush) :
+#ifdef P8Z
+                 s->strategy == Z_OPTIMAL ? deflate_optimal(s, flush) :
+#endif
                  (*(configuration_table[s->level].func))(s, flush);
 
         if (bstate == finish_started || bstate == finish_done) {
@@ -2161,3 +2197,173 @@ local block_state deflate_huff(s, flush)
         FLUSH_BLOCK(s, 0);
     return block_done;
 }
+
+#ifdef P8Z
+/* ===========================================================================
+ * For Z_OPTIMAL, find the longest match at every position of the block, then
+ * choose the literals and matches with a shortest path search where the cost
+ * of each symbol is its code length in the trees of the previous pass. The
+ * first pass uses the greedy parse, and passes are repeated until the block
+ * size stops improving.
+ */
+local block_state deflate_optimal(s, flush)
+    deflate_state *s;
+    int flush;
+{
+    IPos hash_head;          /* head of hash chain */
+    int bflush;              /* set if current block must be flushed */
+    ush lit_cost[LITERALS];  /* symbol costs in bits from the previous pass */
+    ush len_cost[MAX_MATCH+1];
+    ush dist_cost[D_CODES];
+
+    for (;;) {
+        uInt n, i, len, start, avail;
+        ushf *match_len;     /* longest match at each position */
+        ushf *match_dist;    /* and its distance */
+        ushf *parse;         /* symbol length at each symbol start */
+        ushf *best;          /* best parse so far */
+        ushf *from;          /* symbol length at each symbol end */
+        ulg *cost;           /* cheapest cost to reach each position */
+        ulg bits, best_bits = 0;
+        int pass;
+
+        /* Fill the window as much as possible so that blocks are as large
+         * as the literal buffer allows.
+         */
+        if (s->lookahead < s->lit_end + 1 + MIN_LOOKAHEAD) {
+            fill_window(s);
+            if (s->lookahead < MIN_LOOKAHEAD && flush == Z_NO_FLUSH) {
+                return need_more;
+            }
+            if (s->lookahead == 0) break; /* flush the current block */
+        }
+
+        /* Unless flushing, keep enough lookahead for the last match. Also
+         * stop where longest_match() would read past the window; the next
+         * call to fill_window() will slide it.
+         */
+        n = s->lookahead;
+        if (flush == Z_NO_FLUSH) n -= MIN_LOOKAHEAD - 1;
+        if (n > s->lit_end) n = s->lit_end;
+        if (n > s->window_size - MIN_LOOKAHEAD + 1 - s->strstart)
+            n = (uInt)(s->window_size - MIN_LOOKAHEAD + 1 - s->strstart);
+
+        match_len = (ushf *) ZALLOC(s->strm, n, sizeof(ush));
+        match_dist = (ushf *) ZALLOC(s->strm, n, sizeof(ush));
+        parse = (ushf *) ZALLOC(s->strm, n, sizeof(ush));
+        best = (ushf *) ZALLOC(s->strm, n, sizeof(ush));
+        from = (ushf *) ZALLOC(s->strm, n+1, sizeof(ush));
+        cost = (ulg *) ZALLOC(s->strm, n+1, sizeof(ulg));
+        if (match_len == Z_NULL || match_dist == Z_NULL || parse == Z_NULL ||
+            best == Z_NULL || from == Z_NULL || cost == Z_NULL) {
+            TRY_FREE(s->strm, match_len);
+            TRY_FREE(s->strm, match_dist);
+            TRY_FREE(s->strm, parse);
+            TRY_FREE(s->strm, best);
+            TRY_FREE(s->strm, from);
+            TRY_FREE(s->strm, cost);
+            s->strm->msg = ERR_MSG(Z_MEM_ERROR);
+            return finish_started;
+        }
+
+        /* Insert all strings of the block in the dictionary and record the
+         * longest match at each position.
+         */
+        start = s->strstart;
+        avail = s->lookahead;
+        for (i = 0; i < n; i++) {
+            s->strstart = start + i;
+            s->lookahead = avail - i;
+            hash_head = NIL;
+            if (s->lookahead >= MIN_MATCH) {
+                INSERT_STRING(s, s->strstart, hash_head);
+            }
+            match_len[i] = 0;
+            if (hash_head != NIL && s->strstart - hash_head <= MAX_DIST(s)) {
+                s->prev_length = MIN_MATCH-1;
+                len = longest_match(s, hash_head);
+                if (len > n - i) len = n - i;
+                if (len >= MIN_MATCH) {
+                    match_len[i] = (ush)len;
+                    match_dist[i] = (ush)(s->strstart - s->match_start);
+                }
+            }
+        }
+
+        /* The first pass is a greedy parse */
+        for (i = 0; i < n; i += parse[i])
+            parse[i] = match_len[i] ? match_len[i] : 1;
+
+        for (pass = 0; pass < MAX_PASSES; pass++) {
+            if (pass > 0) {
+                /* Find the cheapest path through the block */
+                cost[0] = 0;
+                for (i = 1; i <= n; i++) cost[i] = (ulg)-1;
+                for (i = 0; i < n; i++) {
+                    ulg c = cost[i] + lit_cost[s->window[start + i]];
+                    if (c < cost[i + 1]) cost[i + 1] = c, from[i + 1] = 1;
+                    if (match_len[i]) {
+                        ulg d = cost[i] + dist_cost[d_code(match_dist[i] - 1)];
+                        for (len = MIN_MATCH; len <= match_len[i]; len++) {
+                            c = d + len_cost[len];
+                            if (c < cost[i + len]) cost[i + len] = c, from[i + len] = (ush)len;
+                        }
+                    }
+                }
+                for (i = n; i > 0; i -= from[i])
+                    parse[i - from[i]] = from[i];
+            }
+
+            /* Tally the parse, then measure it and get the symbol costs for
+             * the next pass. Stop as soon as the block does not shrink.
+             */
+            for (i = 0; i < n; i += parse[i]) {
+                if (parse[i] == 1) {
+                    _tr_tally_lit(s, s->window[start + i], bflush);
+                } else {
+                    _tr_tally_dist(s, match_dist[i], parse[i] - MIN_MATCH, bflush);
+                }
+            }
+            bits = _tr_trial_block(s, n, lit_cost, len_cost, dist_cost);
+            if (pass > 0 && bits >= best_bits) break;
+            best_bits = bits;
+            zmemcpy((Bytef *)best, (Bytef *)parse, n * sizeof(ush));
+        }
+
+        /* Tally the best parse for real and flush the block. n is at most
+         * lit_end so bflush can be ignored.
+         */
+        for (i = 0; i < n; i += best[i]) {
+            if (best[i] == 1) {
+                _tr_tally_lit(s, s->window[start + i], bflush);
+            } else {
+                _tr_tally_dist(s, match_dist[i], best[i] - MIN_MATCH, bflush);
+            }
+        }
+        (void)bflush;
+        ZFREE(s->strm, match_len);
+        ZFREE(s->strm, match_dist);
+        ZFREE(s->strm, parse);
+        ZFREE(s->strm, best);
+        ZFREE(s->strm, from);
+        ZFREE(s->strm, cost);
+
+        s->strstart = start + n;
+        s->lookahead = avail - n;
+        s->insert = s->strstart < MIN_MATCH-1 ? s->strstart : MIN_MATCH-1;
+        if (s->lookahead == 0 && flush == Z_FINISH) {
+            FLUSH_BLOCK(s, 1);
+            return finish_done;
+        }
+        FLUSH_BLOCK(s, 0);
+    }
+    s->insert = s->strstart < MIN_MATCH-1 ? s->strstart : MIN_MATCH-1;
+    if (flush == Z_FINISH) {
+        FLUSH_BLOCK(s, 1);
+        return finish_done;
+    }
+    if (s->last_lit)
+        FLUSH_BLOCK(s, 0);
+    return block_done;
+}
+#endif
@@ -241,6 +241,12 @@ typedef struct internal_state {
 
     uInt last_lit;      /* running index in l_buf */
 
+    uInt lit_end;
+    /* The block is flushed when last_lit reaches lit_end. This is
+     * lit_bufsize-1 unless deflateBlockSize() lowered it; the buffers
+     * themselves keep lit_bufsize entries.
+     */
+
     ushf *d_buf;
     /* Buffer for distances. To simplify the code, d_buf and l_buf have
      * the same number of elements. To use different lengths, an extra flag
@@ -304,6 +310,10 @@ void ZLIB_INTERNAL _tr_flush_bits OF((deflate_state *s));
 void ZLIB_INTERNAL _tr_align OF((deflate_state *s));
 void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
                         ulg stored_len, int last));
+#ifdef P8Z
+ulg ZLIB_INTERNAL _tr_trial_block OF((deflate_state *s, ulg stored_len,
+                        ush *lit_cost, ush *len_cost, ush *dist_cost));
+#endif
 
 #define d_code(dist) \
    ((dist) < 256 ? _dist_code[dist] : _dist_code[256+((dist)>>7)])
@@ -328,7 +338,7 @@ void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
     s->d_buf[s->last_lit] = 0; \
     s->l_buf[s->last_lit++] = cc; \
     s->dyn_ltree[cc].Freq++; \
-    flush = (s->last_lit == s->lit_bufsize-1); \
+    flush = (s->last_lit == s->lit_end); \
    }
 # define _tr_tally_dist(s, distance, length, flush) \
   { uch len = (uch)(length); \
@@ -338,7 +348,7 @@ void ZLIB_INTERNAL _tr_stored_block OF((deflate_state *s, charf *buf,
     dist--; \
     s->dyn_ltree[_length_code[len]+LITERALS+1].Freq++; \
     s->dyn_dtree[d_code(dist)].Freq++; \
-    flush = (s->last_lit == s->lit_bufsize-1); \
+    flush = (s->last_lit == s->lit_end); \
   }
 #else
 # define _tr_tally_lit(s, c, flush) flush = _tr_tally(s, 0, c)
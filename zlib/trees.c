@@ -59,6 +59,14 @@
 #define REPZ_11_138  18
 /* repeat a zero length 11-138 times  (7 bits of repeat count) */
 
+#define MAX_P8Z_STORED 32767
+/* Longest stored block, since p8u reads its length as a signed number */
+
+#define PLAN_COST    0
+#define PLAN_SCAN    1
+#define PLAN_SEND    2
+/* plan_tree() modes: measure, count bit length codes, or send them */
+
 local const int extra_lbits[LENGTH_CODES] /* extra bits for each length code */
    = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
 
@@ -148,6 +156,12 @@ local void build_tree     OF((deflate_state *s, tree_desc *desc));
 local void scan_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local void send_tree      OF((deflate_state *s, ct_data *tree, int max_code));
 local int  build_bl_tree  OF((deflate_state *s));
+#ifdef P8Z
+local ulg  plan_tree      OF((deflate_state *s, ct_data *tree, int max_code,
+                              int mode));
+local int  equalize_lengths OF((ct_data *tree, int max_code, ushf *freq));
+local void build_data_trees OF((deflate_state *s));
+#endif
 local void send_all_trees OF((deflate_state *s, int lcodes, int dcodes,
                               int blcodes));
 local void compress_block OF((deflate_state *s, const ct_data *ltree,
@@ -804,6 +818,45 @@ local int build_bl_tree(s)
     deflate_state *s;
 {
     int max_blindex;  /* index of last bit length code of non zero freq */
+#ifdef P8Z
+    ulg opt_len = s->opt_len;
+    ulg bits, best_bits = 0;
+    int n, pass, best_blindex = 0;
+    ct_data best[BL_CODES];
+
+    /* Start from the greedy encoding of zlib, then alternate between the
+     * cheapest encoding of the code lengths for the current bit length
+     * tree, and a new bit length tree for that encoding, until the header
+     * stops shrinking. Freq shares its storage with Code, which the
+     * previous call left in bl_tree, so clear it first.
+     */
+    for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+    scan_tree(s, (ct_data *)s->dyn_ltree, s->l_desc.max_code);
+    scan_tree(s, (ct_data *)s->dyn_dtree, s->d_desc.max_code);
+
+    for (pass = 0; ; pass++) {
+        build_tree(s, (tree_desc *)(&(s->bl_desc)));
+        for (max_blindex = BL_CODES-1; max_blindex >= 3; max_blindex--) {
+            if (s->bl_tree[bl_order[max_blindex]].Len != 0) break;
+        }
+        bits = 3*((ulg)max_blindex+1)
+             + plan_tree(s, (ct_data *)s->dyn_ltree, s->l_desc.max_code, PLAN_COST)
+             + plan_tree(s, (ct_data *)s->dyn_dtree, s->d_desc.max_code, PLAN_COST);
+        if (pass > 0 && bits >= best_bits) break;
+        best_bits = bits;
+        best_blindex = max_blindex;
+        zmemcpy((Bytef *)best, (Bytef *)s->bl_tree, sizeof(best));
+
+        for (n = 0; n < BL_CODES; n++) s->bl_tree[n].Freq = 0;
+        plan_tree(s, (ct_data *)s->dyn_ltree, s->l_desc.max_code, PLAN_SCAN);
+        plan_tree(s, (ct_data *)s->dyn_dtree, s->d_desc.max_code, PLAN_SCAN);
+    }
+    zmemcpy((Bytef *)s->bl_tree, (Bytef *)best, sizeof(best));
+    max_blindex = best_blindex;
+
+    /* Update opt_len to include the tree representations and counts */
+    s->opt_len = opt_len + best_bits + 5+5+4;
+#else
 
     /* Determine the bit length frequencies for literal and distance trees */
     scan_tree(s, (ct_data *)s->dyn_ltree, s->l_desc.max_code);
@@ -824,12 +877,178 @@ local int build_bl_tree(s)
     }
     /* Update opt_len to include the bit length tree and counts */
     s->opt_len += 3*((ulg)max_blindex+1) + 5+5+4;
+#endif
     Tracev((stderr, "\ndyn trees: dyn %ld, stat %ld",
             s->opt_len, s->static_len));
 
     return max_blindex;
 }
 
+#ifdef P8Z
+/* ===========================================================================
+ * Find the cheapest encoding of the code lengths of a tree with the current
+ * bit length tree, using only the codes it contains. Depending on mode,
+ * return its size in bits, add its codes to the bit length frequencies, or
+ * send it. Like the P8Z decoder, a tree never starts with REP_3_6 and runs
+ * never extend to the next tree.
+ */
+local ulg plan_tree(s, tree, max_code, mode)
+    deflate_state *s;
+    ct_data *tree;   /* the tree to be encoded */
+    int max_code;    /* and its largest code of non zero frequency */
+    int mode;        /* PLAN_COST, PLAN_SCAN or PLAN_SEND */
+{
+    ulg cost[L_CODES+1];   /* cheapest cost of the first n code lengths */
+    uch code[L_CODES+1];   /* last bit length code used to get there */
+    ush count[L_CODES+1];  /* and its repeat count */
+    ush start[L_CODES+1];  /* position of that code in the tree */
+    ulg bl_cost[BL_CODES];
+    int n, k, len = max_code + 1;
+
+    for (n = 0; n < BL_CODES; n++) {
+        bl_cost[n] = s->bl_tree[n].Len ? (ulg)(s->bl_tree[n].Len + extra_blbits[n])
+                                       : (ulg)-1;
+    }
+    cost[0] = 0;
+    for (n = 1; n <= len; n++) cost[n] = (ulg)-1;
+
+#define PLAN_STEP(c, k) { \
+    ulg step = cost[n] + bl_cost[c]; \
+    if (bl_cost[c] != (ulg)-1 && step < cost[n+(k)]) \
+        cost[n+(k)] = step, code[n+(k)] = (uch)(c), \
+        count[n+(k)] = (ush)(k), start[n+(k)] = (ush)n; \
+}
+    for (n = 0; n < len; n++) {
+        int curlen = tree[n].Len;
+        if (cost[n] == (ulg)-1) continue;
+        PLAN_STEP(curlen, 1);
+        /* Repeat the previous length */
+        for (k = 1; n > 0 && k <= 6 && n + k <= len
+                    && tree[n+k-1].Len == tree[n-1].Len; k++) {
+            if (k >= 3) PLAN_STEP(REP_3_6, k);
+        }
+        /* Runs of zeros */
+        for (k = 1; k <= 138 && n + k <= len && tree[n+k-1].Len == 0; k++) {
+            if (k >= 3 && k <= 10) PLAN_STEP(REPZ_3_10, k);
+            if (k >= 11) PLAN_STEP(REPZ_11_138, k);
+        }
+    }
+#undef PLAN_STEP
+    Assert(cost[len] != (ulg)-1, "no way to encode tree");
+
+    if (mode != PLAN_COST) {
+        /* Walk the path back, then forward to count or send the codes */
+        ush next[L_CODES+1];
+        for (n = len; n > 0; n = start[n]) next[start[n]] = (ush)n;
+        for (n = 0; n < len; n = next[n]) {
+            int c = code[next[n]], k = count[next[n]];
+            if (mode == PLAN_SCAN) {
+                s->bl_tree[c].Freq++;
+            } else {
+                send_code(s, c, s->bl_tree);
+                if (c == REP_3_6) {
+                    send_bits(s, k-3, 2);
+                } else if (c == REPZ_3_10) {
+                    send_bits(s, k-3, 3);
+                } else if (c == REPZ_11_138) {
+                    send_bits(s, k-11, 7);
+                }
+            }
+        }
+    }
+    return cost[len];
+}
+
+/* ===========================================================================
+ * Symbols with the same frequency can swap code lengths without changing the
+ * size of the compressed data. Swap them where this makes longer runs of
+ * equal code lengths, which are cheaper to send, and regenerate the codes.
+ * Return whether anything changed.
+ */
+local int equalize_lengths(tree, max_code, freq)
+    ct_data *tree;   /* the tree to be modified */
+    int max_code;    /* and its largest code of non zero frequency */
+    ushf *freq;      /* the symbol frequencies used to build the tree */
+{
+    ush bl_count[MAX_BITS+1];
+    int a, b, i, changed = 0, improved;
+
+    /* Number of code length changes at positions (x, x-1) in the tree */
+#define BREAKS(x, y) ( \
+    ((x) > 0 && (x) <= max_code && tree[x].Len != tree[(x)-1].Len) + \
+    ((y) != (x) && (y) > 0 && (y) <= max_code && tree[y].Len != tree[(y)-1].Len))
+    do {
+        improved = 0;
+        for (a = 0; a <= max_code; a++) {
+            for (b = a + 1; b <= max_code; b++) {
+                ush tmp;
+                int before;
+                if (!freq[a] || freq[a] != freq[b] || tree[a].Len == tree[b].Len)
+                    continue;
+                before = BREAKS(a, a+1) + BREAKS(b == a+1 ? b+1 : b, b+1);
+                tmp = tree[a].Len, tree[a].Len = tree[b].Len, tree[b].Len = tmp;
+                if (BREAKS(a, a+1) + BREAKS(b == a+1 ? b+1 : b, b+1) < before) {
+                    improved = changed = 1;
+                } else {
+                    tmp = tree[a].Len, tree[a].Len = tree[b].Len, tree[b].Len = tmp;
+                }
+            }
+        }
+    } while (improved);
+#undef BREAKS
+
+    if (changed) {
+        for (i = 0; i <= MAX_BITS; i++) bl_count[i] = 0;
+        for (i = 0; i <= max_code; i++) bl_count[tree[i].Len]++;
+        bl_count[0] = 0;
+        gen_codes(tree, max_code, bl_count);
+    }
+    return changed;
+}
+
+/* ===========================================================================
+ * Build the literal and distance trees, then try code length assignments
+ * that give the same data size with a smaller header. As with build_tree(),
+ * opt_len and static_len only include the data.
+ */
+local void build_data_trees(s)
+    deflate_state *s;
+{
+    ush lfreq[L_CODES], dfreq[D_CODES];
+    ct_data ltree[L_CODES], dtree[D_CODES];
+    ulg opt_len, before;
+    int n, changed;
+
+    for (n = 0; n < L_CODES; n++) lfreq[n] = s->dyn_ltree[n].Freq;
+    for (n = 0; n < D_CODES; n++) dfreq[n] = s->dyn_dtree[n].Freq;
+
+    build_tree(s, (tree_desc *)(&(s->l_desc)));
+    Tracev((stderr, "\nlit data: dyn %ld, stat %ld", s->opt_len,
+            s->static_len));
+    build_tree(s, (tree_desc *)(&(s->d_desc)));
+    Tracev((stderr, "\ndist data: dyn %ld, stat %ld", s->opt_len,
+            s->static_len));
+
+    opt_len = s->opt_len;
+    build_bl_tree(s);
+    before = s->opt_len;
+    zmemcpy((Bytef *)ltree, (Bytef *)s->dyn_ltree, sizeof(ltree));
+    zmemcpy((Bytef *)dtree, (Bytef *)s->dyn_dtree, sizeof(dtree));
+
+    changed = equalize_lengths(s->dyn_ltree, s->l_desc.max_code, lfreq);
+    changed |= equalize_lengths(s->dyn_dtree, s->d_desc.max_code, dfreq);
+    if (changed) {
+        s->opt_len = opt_len;
+        build_bl_tree(s);
+        if (s->opt_len >= before) {
+            zmemcpy((Bytef *)s->dyn_ltree, (Bytef *)ltree, sizeof(ltree));
+            zmemcpy((Bytef *)s->dyn_dtree, (Bytef *)dtree, sizeof(dtree));
+        }
+    }
+    s->opt_len = opt_len;
+}
+#endif
+
 /* ===========================================================================
  * Send the header for a block using dynamic Huffman trees: the counts, the
  * lengths of the bit length codes, the literal tree and the distance tree.
@@ -854,10 +1073,17 @@ local void send_all_trees(s, lcodes, dcodes, blcodes)
     }
     Tracev((stderr, "\nbl tree: sent %ld", s->bits_sent));
 
+#ifdef P8Z
+    plan_tree(s, (ct_data *)s->dyn_ltree, lcodes-1, PLAN_SEND); /* literal tree */
+    Tracev((stderr, "\nlit tree: sent %ld", s->bits_sent));
+
+    plan_tree(s, (ct_data *)s->dyn_dtree, dcodes-1, PLAN_SEND); /* distance tree */
+#else
     send_tree(s, (ct_data *)s->dyn_ltree, lcodes-1); /* literal tree */
     Tracev((stderr, "\nlit tree: sent %ld", s->bits_sent));
 
     send_tree(s, (ct_data *)s->dyn_dtree, dcodes-1); /* distance tree */
+#endif
     Tracev((stderr, "\ndist tree: sent %ld", s->bits_sent));
 }
 
@@ -875,7 +1101,7 @@ void ZLIB_INTERNAL _tr_stored_block(s, buf, stored_len, last)
     send_bits(s, 2, 2); /* send block header */
     send_bits(s, (ush)stored_len, 16);
     for (ulg i = 0; i < stored_len; ++i)
-        send_bits(s, buf[i], 8);
+        send_bits(s, (uch)buf[i], 8);
 #else
     send_bits(s, (STORED_BLOCK<<1)+last, 3);    /* send block type */
     bi_windup(s);        /* align on byte boundary */
@@ -892,6 +1118,59 @@ void ZLIB_INTERNAL _tr_stored_block(s, buf, stored_len, last)
 #endif
 }
 
+#ifdef P8Z
+/* ===========================================================================
+ * Build the trees for the symbols tallied so far without sending anything,
+ * store the cost in bits of each literal, match length and distance code
+ * with the cheapest trees, and reset the block. Return the size in bits of
+ * the cheapest encoding of the block.
+ */
+ulg ZLIB_INTERNAL _tr_trial_block(s, stored_len, lit_cost, len_cost, dist_cost)
+    deflate_state *s;
+    ulg stored_len;   /* length of input block */
+    ush *lit_cost;    /* cost of each literal */
+    ush *len_cost;    /* cost of each match length, with extra bits */
+    ush *dist_cost;   /* cost of each distance code, with extra bits */
+{
+    const ct_data *ltree = s->dyn_ltree, *dtree = s->dyn_dtree;
+    ulg opt_bits, static_bits, stored_bits;
+    int n, lmax = 0, dmax = 0;
+
+    build_data_trees(s);
+    build_bl_tree(s);
+
+    opt_bits = s->opt_len + 2;
+    static_bits = s->static_len + 2;
+    stored_bits = stored_len <= MAX_P8Z_STORED ? 2 + 16 + (stored_len << 3)
+                                               : (ulg)-1;
+    if (static_bits <= opt_bits) {
+        ltree = static_ltree, dtree = static_dtree;
+        opt_bits = static_bits;
+    }
+
+    /* Symbols that were not used get a slightly longer code than the
+     * longest one, to let the next pass try them at a reasonable cost.
+     */
+    for (n = 0; n < L_CODES; n++) if (ltree[n].Len > lmax) lmax = ltree[n].Len;
+    for (n = 0; n < D_CODES; n++) if (dtree[n].Len > dmax) dmax = dtree[n].Len;
+    lmax = lmax < MAX_BITS ? lmax + 1 : MAX_BITS;
+    dmax = dmax < MAX_BITS ? dmax + 1 : MAX_BITS;
+
+    for (n = 0; n < LITERALS; n++)
+        lit_cost[n] = ltree[n].Len ? ltree[n].Len : (ush)lmax;
+    for (n = MIN_MATCH; n <= MAX_MATCH; n++) {
+        int code = _length_code[n - MIN_MATCH];
+        len_cost[n] = (ush)((ltree[code+LITERALS+1].Len ? ltree[code+LITERALS+1].Len
+                                                       : lmax) + extra_lbits[code]);
+    }
+    for (n = 0; n < D_CODES; n++)
+        dist_cost[n] = (ush)((dtree[n].Len ? dtree[n].Len : dmax) + extra_dbits[n]);
+
+    init_block(s);
+    return opt_bits < stored_bits ? opt_bits : stored_bits;
+}
+#endif
+
 /* ===========================================================================
  * Flush the bits in the bit buffer to pending output (leaves at most 7 bits)
  */
@@ -937,6 +1216,9 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
             s->strm->data_type = detect_data_type(s);
 
         /* Construct the literal and distance trees */
+#ifdef P8Z
+        build_data_trees(s);
+#else
         build_tree(s, (tree_desc *)(&(s->l_desc)));
         Tracev((stderr, "\nlit data: dyn %ld, stat %ld", s->opt_len,
                 s->static_len));
@@ -944,6 +1226,7 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
         build_tree(s, (tree_desc *)(&(s->d_desc)));
         Tracev((stderr, "\ndist data: dyn %ld, stat %ld", s->opt_len,
                 s->static_len));
+#endif
         /* At this point, opt_len and static_len are the total bit lengths of
          * the compressed block data, excluding the tree representations.
          */
@@ -953,6 +1236,19 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
          */
         max_blindex = build_bl_tree(s);
 
+#ifdef P8Z
+        /* Determine the best encoding from the exact block sizes in bits:
+         * all block headers are 2 bits, and a stored block has a 16-bit
+         * length followed by the raw bytes, with no alignment.
+         */
+        opt_lenb = s->opt_len + 2;
+        static_lenb = s->static_len + 2;
+
+        Tracev((stderr, "\nopt %lu stat %lu stored %lu lit %u ",
+                opt_lenb, static_lenb, stored_len, s->last_lit));
+
+        if (static_lenb <= opt_lenb || s->strategy == Z_FIXED) opt_lenb = static_lenb;
+#else
         /* Determine the best encoding. Compute the block lengths in bytes. */
         opt_lenb = (s->opt_len+3+7)>>3;
         static_lenb = (s->static_len+3+7)>>3;
@@ -962,6 +1258,7 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
                 s->last_lit));
 
         if (static_lenb <= opt_lenb) opt_lenb = static_lenb;
+#endif
 
     } else {
         Assert(buf != (char*)0, "lost buf");
@@ -970,6 +1267,10 @@ void ZLIB_INTERNAL _tr_flush_block(s, buf, stored_len, last)
 
 #ifdef FORCE_STORED
     if (buf != (char*)0) { /* force stored block */
+#elif defined(P8Z)
+    if ((s->level == 0 || 2 + 16 + (stored_len << 3) <= opt_lenb)
+         && stored_len <= MAX_P8Z_STORED && buf != (char*)0) {
+                       /* the decoder reads the length as a signed number */
 #else
     if (stored_len+4 <= opt_lenb && buf != (char*)0) {
                        /* 4: two words for the lengths */
@@ -1074,7 +1375,7 @@ int ZLIB_INTERNAL _tr_tally (s, dist, lc)
         if (s->matches < s->last_lit/2 && out_length < in_length/2) return 1;
     }
 #endif
-    return (s->last_lit == s->lit_bufsize-1);
+    return (s->last_lit == s->lit_end);
     /* We avoid equality with lit_bufsize because of wraparound at 64K
      * on 16 bit machines and because stored blocks are restricted to
      * 64K-1 bytes.
@@ -197,6 +197,9 @@ typedef gz_header FAR *gz_headerp;
 #define Z_HUFFMAN_ONLY        2
 #define Z_RLE                 3
 #define Z_FIXED               4
+#ifdef P8Z
+#define Z_OPTIMAL             5
+#endif
 #define Z_DEFAULT_STRATEGY    0
 /* compression strategy; see deflateInit2() below for details */
 
@@ -598,7 +601,9 @@ ZEXTERN int ZEXPORT deflateInit2 OF((z_streamp strm,
    strategy parameter only affects the compression ratio but not the
    correctness of the compressed output even if it is not set appropriately.
    Z_FIXED prevents the use of dynamic Huffman codes, allowing for a simpler
-   decoder for special applications.
+   decoder for special applications.  Z_OPTIMAL (P8Z only) replaces the lazy
+   match search with a parse that minimises the block size, alternating parse
+   and tree-building passes until the size stops improving; it is much slower.
 
      deflateInit2 returns Z_OK if success, Z_MEM_ERROR if there was not enough
    memory, Z_STREAM_ERROR if any parameter is invalid (such as an invalid
@@ -757,6 +762,20 @@ ZEXTERN int ZEXPORT deflateTune OF((z_streamp strm,
    returns Z_OK on success, or Z_STREAM_ERROR for an invalid deflate stream.
  */
 
+#ifdef P8Z
+ZEXTERN int ZEXPORT deflateBlockSize OF((z_streamp strm,
+                                         unsigned max_symbols));
+/*
+     Limit the number of literals and matches in each block to max_symbols,
+   which cannot be raised above the limit set by memLevel.  Decoders that
+   stop between blocks then have a bounded amount of work between two stops.
+
+     deflateBlockSize() can be called after deflateInit() or deflateInit2()
+   and before the first call of deflate(); it returns Z_OK on success, or
+   Z_STREAM_ERROR for an invalid deflate stream or a max_symbols of zero.
+ */
+#endif
+
 ZEXTERN uLong ZEXPORT deflateBound OF((z_streamp strm,
                                        uLong sourceLen));
 /*